@@ -1,89 +1,2724 @@
 /*
  * Standalone ITTAPI tracer
- * Overrides ITTAPI functions using LD_PRELOAD
+ * Overrides ITTAPI functions using LD_PRELOAD, or serves as the collector
+ * library that static ittnotify loads from INTEL_LIBITTNOTIFY64
  * Outputs JSON trace
  */
 
 #define INTEL_NO_MACRO_BODY
 #include "colintrace.h"
 
-#include <iostream>
-#include <fstream>
-#include <stack>
 #include <string>
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <vector>
 #include <map>
+#include <regex>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <tuple>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <limits>
 #include <unistd.h>
 #include <syscall.h>
+#include <sys/prctl.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <cxxabi.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <ctime>
+#include <pthread.h>
 
 // --- Global State ---
-static std::ofstream* g_trace_file_ptr = nullptr;
+static FILE* g_trace_file = nullptr;
 static std::mutex g_file_mutex;
 static std::atomic<bool> g_is_first_event{true};
 
-// Maps to store created domains and string handles, ensuring pointer identity
+// Collection state set by __itt_pause/__itt_resume/__itt_detach. Every override
+// loads it before doing anything else so that a paused tracer costs one
+// relaxed load per call.
+enum CollectionState { kCollecting = 0, kPaused = 1, kDetached = 2 };
+static std::atomic<int> g_collection_state{kCollecting};
+static std::atomic<long long> g_pause_us{0};
+// Only every Nth task begun on a thread is written; the others are pushed as
+// placeholders. Set at runtime through the control channel.
+static std::atomic<unsigned> g_sample_period{1};
+static thread_local unsigned g_sample_tick = 0;
+
+static inline bool collecting() {
+    return __builtin_expect(g_collection_state.load(std::memory_order_relaxed) == kCollecting, 1);
+}
+
+static inline bool detached() {
+    return g_collection_state.load(std::memory_order_relaxed) == kDetached;
+}
+
+// Maps to store created domains and string handles, ensuring pointer identity.
+// These and the other tables reachable from ITT entry points are
+// function-local statics, so that ITT calls made from other libraries' static
+// constructors work before this file's initializers have run.
 static std::mutex g_domain_mutex;
-static std::map<std::string, __itt_domain*> g_domain_map;
+static std::map<std::string, __itt_domain*>& domain_map() {
+    static auto* map = new std::map<std::string, __itt_domain*>();
+    return *map;
+}
+
+static std::mutex g_string_handle_mutex;
+static std::map<std::string, __itt_string_handle*>& string_handle_map() {
+    static auto* map = new std::map<std::string, __itt_string_handle*>();
+    return *map;
+}
+
+// Global state for ITT events
+// Events live in fixed-size chunks that are never moved, so event start/end
+// can index them without the mutex: a slot is filled before g_event_count is
+// published past it.
+struct EventInfo {
+    std::string name; // JSON-escaped
+    bool filtered = false;
+};
+
+static constexpr size_t kEventChunk = 256;
+static constexpr size_t kEventChunks = 4096;
+static std::mutex g_event_mutex;
+static std::atomic<EventInfo*> g_event_chunks[kEventChunks];
+static std::atomic<size_t> g_event_count{0};
+
+static const EventInfo* find_event(__itt_event event) {
+    if (event < 0 || static_cast<size_t>(event) >= g_event_count.load(std::memory_order_acquire)) return nullptr;
+    return &g_event_chunks[event / kEventChunk].load(std::memory_order_relaxed)[event % kEventChunk];
+}
+
+// --- Task Arguments ---
+// Metadata attached to an open task is packed into a fixed slot on its frame,
+// so the common case of a few scalars or a short string costs a memcpy and no
+// allocation. Entries that do not fit are formatted into an overflow string.
+struct TaskArgs {
+    static constexpr size_t kCapacity = 96;
+    static constexpr uint8_t kStringType = 0xff;
+
+    struct Header {
+        __itt_string_handle* key;
+        uint32_t count; // element count, or byte length for strings
+        uint8_t type;   // __itt_metadata_type, or kStringType
+    };
+
+    TaskArgs() : used(0) {} // leave bytes uninitialized, frames are pushed often
+
+    // Frames move when the stack grows and when they are popped; only the
+    // used part of bytes is copied.
+    TaskArgs(TaskArgs&& other) noexcept : used(other.used), overflow(std::move(other.overflow)) {
+        memcpy(bytes, other.bytes, used);
+    }
+
+    TaskArgs& operator=(TaskArgs&& other) noexcept {
+        if (this != &other) {
+            used = other.used;
+            memcpy(bytes, other.bytes, used);
+            overflow = std::move(other.overflow);
+        }
+        return *this;
+    }
+
+    alignas(8) unsigned char bytes[kCapacity];
+    uint32_t used;
+    std::unique_ptr<std::string> overflow;
+};
+
+// Heap activity attributed to a task frame by the __itt_heap_* overrides.
+struct HeapCounters {
+    unsigned long long allocs = 0;
+    unsigned long long alloc_bytes = 0;
+    unsigned long long frees = 0;
+    unsigned long long freed_bytes = 0;
+    unsigned long long heap_ns = 0;
+};
+
+// Tasks begun while collection is paused are pushed as placeholders with no
+// timestamp so that their matching __itt_task_end still pops the right frame.
+struct TaskInfo {
+    const __itt_domain* domain;
+    __itt_string_handle* name = nullptr;
+    long long start_us = 0;
+    __itt_id id = __itt_null;
+    TaskArgs args;
+    HeapCounters heap;
+    bool placeholder = false;
+    void* fn = nullptr; // set instead of name by __itt_task_begin_fn
+
+    explicit TaskInfo(const __itt_domain* placeholder_domain) : domain(placeholder_domain), placeholder(true) {}
+    TaskInfo(const __itt_domain* task_domain, __itt_string_handle* task_name, void* task_fn, long long start, const __itt_id& task_id)
+        : domain(task_domain), name(task_name), start_us(start), id(task_id), fn(task_fn) {}
+};
+
+// Per-thread storage for ongoing events and tasks
+// A vector rather than std::stack so that __itt_task_end can look below the
+// top for the frame of its own domain.
+using TaskStack = std::vector<TaskInfo>;
+static thread_local TaskStack g_task_stack;
+static thread_local std::map<__itt_event, std::chrono::time_point<std::chrono::high_resolution_clock>> g_event_start_times;
+
+
+// --- Overlapped Task Table ---
+// Overlapped tasks can begin on one thread and end on another, so their start
+// times cannot live in g_task_stack. They are keyed by __itt_id in a table split
+// into independently locked shards; concurrent async operations only contend
+// when their ids hash to the same shard.
+struct OverlappedTask {
+    std::string name;
+    long long start_us;
+    long tid;
+};
+
+struct IdHash {
+    size_t operator()(const __itt_id& id) const {
+        unsigned long long h = id.d1 * 0x9E3779B97F4A7C15ULL;
+        h ^= (id.d2 + 0x632BE59BD9B4E019ULL) + (h << 6) + (h >> 2);
+        h ^= (id.d3 + 0x85EBCA77C2B2AE63ULL) + (h << 6) + (h >> 2);
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+};
+
+struct IdEqual {
+    bool operator()(const __itt_id& a, const __itt_id& b) const {
+        return a.d1 == b.d1 && a.d2 == b.d2 && a.d3 == b.d3;
+    }
+};
+
+struct AddressHash {
+    size_t operator()(const void* addr) const {
+        unsigned long long h = reinterpret_cast<uintptr_t>(addr) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(h ^ (h >> 29));
+    }
+};
+
+template <typename K, typename V, typename Hash, typename Equal = std::equal_to<K>>
+class ShardedMap {
+public:
+    void insert(const K& id, V value) {
+        Shard& s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.map[id] = std::move(value);
+    }
+
+    // Runs fn on the entry for id under the shard lock, creating it if absent.
+    template <typename F>
+    void update(const K& id, F&& fn) {
+        Shard& s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        fn(s.map[id]);
+    }
+
+    // Runs fn on the entry for id under the shard lock if there is one, and
+    // erases the entry if fn returns true. Returns false if id was absent.
+    template <typename F>
+    bool update_existing(const K& id, F&& fn) {
+        Shard& s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.map.find(id);
+        if (it == s.map.end()) return false;
+        if (fn(it->second)) s.map.erase(it);
+        return true;
+    }
+
+    void erase(const K& id) {
+        Shard& s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.map.erase(id);
+    }
+
+    void clear() {
+        for (Shard& s : m_shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            decltype(s.map)().swap(s.map);
+        }
+    }
+
+    // Removes the entry for id and moves it into out. Returns false if absent.
+    bool take(const K& id, V& out) {
+        Shard& s = shard_for(id);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.map.find(id);
+        if (it == s.map.end()) return false;
+        out = std::move(it->second);
+        s.map.erase(it);
+        return true;
+    }
+
+private:
+    static constexpr size_t kShardCount = 64;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<K, V, Hash, Equal> map;
+    };
+
+    Shard& shard_for(const K& id) {
+        return m_shards[(Hash()(id) >> 7) % kShardCount];
+    }
+
+    Shard m_shards[kShardCount];
+};
+
+template <typename V>
+using ShardedIdMap = ShardedMap<__itt_id, V, IdHash, IdEqual>;
+
+static ShardedIdMap<OverlappedTask>& overlapped_tasks() {
+    static auto* table = new ShardedIdMap<OverlappedTask>();
+    return *table;
+}
+
+static bool is_null_id(const __itt_id& id) {
+    return id.d1 == 0 && id.d2 == 0 && id.d3 == 0;
+}
+
+// --- Task Instances and Relations ---
+// Task ids are ignored until the first __itt_id_create or relation; most
+// applications pass __itt_id_make ids without ever relating them. From then
+// on every task with an id gets an instance entry, recording where and when
+// it ran, while it is running. Entries that __itt_id_create did not register
+// are erased when their task ends. The ends of unregistered tasks always go
+// to a fixed-size ring of recent ends, so that a relation added after its
+// source ended (the usual producer -> consumer pattern, including the very
+// first relation) can still be placed.
+//
+// A relation between two instances becomes a Chrome flow: the "s" half is
+// written once the source task has ended and the "f" half once the target
+// task has begun, so each half waits on its own instance only. A relation
+// whose source is neither running, registered nor among the recent ends is
+// dropped, so no "f" is written without its "s".
+struct TaskInstance {
+    long begin_tid = 0;
+    long end_tid = 0;
+    long long begin_us = -1;
+    long long end_us = -1;
+    bool registered = false; // by __itt_id_create, kept until __itt_id_destroy
+    std::vector<unsigned long long> pending_out; // flows waiting for this task to end
+    std::vector<unsigned long long> pending_in;  // flows waiting for this task to begin
+};
+
+struct RecentEnd {
+    __itt_id id;
+    long long flow_ts;
+    long tid;
+};
+
+static constexpr size_t kRecentEndShards = 64;
+static constexpr size_t kRecentEndsPerShard = 64;
+
+struct alignas(64) RecentEndShard {
+    std::mutex mutex;
+    RecentEnd ends[kRecentEndsPerShard] = {};
+    size_t next = 0;
+};
+
+static ShardedIdMap<TaskInstance>& task_instances() {
+    static auto* table = new ShardedIdMap<TaskInstance>();
+    return *table;
+}
+static RecentEndShard g_recent_ends[kRecentEndShards];
+// Set by the first id registration or relation; until then tasks with ids
+// skip the instance table altogether.
+static std::atomic<bool> g_instances_used{false};
+static std::atomic<unsigned long long> g_next_flow_id{1};
+
+// Ids handed out for tasks that were begun without one but later became the
+// head of __itt_relation_add_to_current. d3 keeps them apart from user ids.
+static std::atomic<unsigned long long> g_next_synthetic_id{1};
+static constexpr unsigned long long kSyntheticIdTag = 0xc0117ace00000000ULL;
+
+// --- Utility Functions ---
+static long long env_ll(const char* name, long long default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) return default_value;
+    char* end = nullptr;
+    long long parsed = strtoll(value, &end, 10);
+    return (end && *end == '\0') ? parsed : default_value;
+}
+
+static long long get_time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now().time_since_epoch()
+    ).count();
+}
+
+// --- Per-Thread Output Buffers ---
+// Entries are appended to a buffer owned by the writing thread and moved to
+// the file in chunks of kThreadBufferBytes, so the file mutex is taken once per
+// chunk instead of once per event. A buffer's own mutex is only contended when
+// finalize_trace drains the buffers of threads that are still running.
+//
+// Buffers come from a fixed pool of COLINTRACE_BUFFER_POOL slots allocated
+// once, so tracer memory stays flat however many threads come and go. A
+// thread takes a slot on its first entry and gives it back at exit; the free
+// slots form a Treiber stack of slot indexes whose head carries a tag in the
+// upper 32 bits against ABA, so neither step takes a lock. A slot keeps its
+// string capacity across owners. Threads that find the pool empty write their
+// entries straight to the file.
+struct ThreadBuffer {
+    std::mutex mutex;
+    std::string data;              // entries, each preceded by ",\n"
+    std::atomic<uint32_t> next{0}; // free-list link, slot index + 1
+};
+
+struct BufferPool {
+    ThreadBuffer* slots = nullptr;
+    uint32_t size = 0;
+    std::atomic<uint64_t> head{0}; // tag << 32 | (slot index + 1), 0 when empty
+};
+
+static constexpr size_t kThreadBufferBytes = 64 * 1024;
+static thread_local ThreadBuffer* g_thread_buffer = nullptr;
+// Set when the pool was empty, and after the thread's exit hook has run.
+static thread_local bool g_thread_unbuffered = false;
+
+// Function-local so that ITT calls made from other libraries' static
+// constructors work before this file's initializers have run.
+static BufferPool& buffer_pool() {
+    static BufferPool* pool = [] {
+        BufferPool* p = new BufferPool();
+        p->size = static_cast<uint32_t>(std::max(0LL, std::min(env_ll("COLINTRACE_BUFFER_POOL", 256), 1LL << 20)));
+        p->slots = new ThreadBuffer[p->size];
+        for (uint32_t i = 0; i + 1 < p->size; ++i) p->slots[i].next.store(i + 2, std::memory_order_relaxed);
+        p->head.store(p->size ? 1 : 0, std::memory_order_release);
+        return p;
+    }();
+    return *pool;
+}
+
+static void arm_thread_exit_hook();
+
+// Set while the thread is inside a heap hook or writing an entry. Allocators
+// annotated with __itt_heap_* call back into the tracer from the allocations
+// made there; the heap hooks ignore those calls instead of recursing into
+// themselves or relocking a buffer or file mutex the thread already holds.
+static thread_local bool g_heap_hooks_blocked = false;
+
+struct HeapHookBlock {
+    bool was_blocked;
+    HeapHookBlock() : was_blocked(g_heap_hooks_blocked) { g_heap_hooks_blocked = true; }
+    ~HeapHookBlock() { g_heap_hooks_blocked = was_blocked; }
+};
+
+// Set while the segment writer thread owns the trace file; chunks are then
+// queued for it instead of written by the producing thread.
+static std::atomic<bool> g_rotating{false};
+static void enqueue_chunk(std::string& chunk);
+
+static void write_file_chunk(const char* data, size_t size) {
+    HeapHookBlock block;
+    std::lock_guard<std::mutex> lock(g_file_mutex);
+    if (g_trace_file) {
+        if (g_is_first_event.exchange(false)) {
+            data += 2; // no separator before the first entry
+            size -= 2;
+        }
+        fwrite(data, 1, size, g_trace_file);
+    }
+}
+
+static void resolve_symbol_markers(std::string& chunk);
+
+// Writes or queues chunk and leaves it empty.
+static void write_chunk(std::string& chunk) {
+    resolve_symbol_markers(chunk);
+    if (g_rotating.load(std::memory_order_acquire)) {
+        enqueue_chunk(chunk);
+    } else {
+        write_file_chunk(chunk.data(), chunk.size());
+        chunk.clear();
+    }
+}
+
+// The caller holds buffer.mutex.
+static void flush_buffer(ThreadBuffer& buffer) {
+    if (!buffer.data.empty()) write_chunk(buffer.data);
+}
+
+static ThreadBuffer* acquire_thread_buffer() {
+    if (detached()) return nullptr;
+    arm_thread_exit_hook();
+    BufferPool& pool = buffer_pool();
+    uint64_t head = pool.head.load(std::memory_order_acquire);
+    for (;;) {
+        uint32_t index = static_cast<uint32_t>(head);
+        if (index == 0) return nullptr;
+        uint32_t next = pool.slots[index - 1].next.load(std::memory_order_relaxed);
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (pool.head.compare_exchange_weak(head, new_head, std::memory_order_acquire, std::memory_order_acquire)) {
+            ThreadBuffer* buffer = &pool.slots[index - 1];
+            if (buffer->data.capacity() < kThreadBufferBytes) buffer->data.reserve(kThreadBufferBytes + 4096);
+            return buffer;
+        }
+    }
+}
+
+static void release_thread_buffer(ThreadBuffer* buffer) {
+    {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        flush_buffer(*buffer);
+    }
+    BufferPool& pool = buffer_pool();
+    uint32_t index = static_cast<uint32_t>(buffer - pool.slots) + 1;
+    uint64_t head = pool.head.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        buffer->next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!pool.head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Free slots are empty, so every slot can be drained without knowing which
+// ones are in use.
+static void flush_all_buffers() {
+    BufferPool& pool = buffer_pool();
+    for (uint32_t i = 0; i < pool.size; ++i) {
+        std::lock_guard<std::mutex> lock(pool.slots[i].mutex);
+        flush_buffer(pool.slots[i]);
+    }
+}
+
+// Frees the string storage of every slot after __itt_detach has drained them.
+// Slots still owned by running threads stay owned, but only regrow if those
+// threads write again, and those entries are dropped with the file closed.
+static void release_buffer_pool() {
+    BufferPool& pool = buffer_pool();
+    for (uint32_t i = 0; i < pool.size; ++i) {
+        std::lock_guard<std::mutex> lock(pool.slots[i].mutex);
+        std::string().swap(pool.slots[i].data);
+    }
+}
+
+// --- Lazy Initialization ---
+// Nothing is opened or started until the process makes its first ITT call
+// (a handle creation or the first trace entry), so programs that only
+// inherit LD_PRELOAD through an exec chain leave no trace file behind.
+// The once-flag is hand-rolled rather than std::call_once because
+// tracer_init writes entries itself and so re-enters on the same thread.
+enum InitState { kUninitialized, kInitializing, kInitialized };
+static std::atomic<int> g_init_state{kUninitialized};
+static thread_local bool g_initializing = false;
+
+static void tracer_init();
+
+static bool initialized() {
+    return g_init_state.load(std::memory_order_acquire) == kInitialized;
+}
+
+static void ensure_initialized() {
+    if (__builtin_expect(initialized(), 1) || g_initializing) return;
+    int expected = kUninitialized;
+    if (g_init_state.compare_exchange_strong(expected, kInitializing, std::memory_order_acq_rel)) {
+        g_initializing = true;
+        tracer_init();
+        g_initializing = false;
+        g_init_state.store(kInitialized, std::memory_order_release);
+        return;
+    }
+    while (!initialized()) std::this_thread::yield();
+}
+
+static void write_trace_entry(const char* entry, size_t size) {
+    HeapHookBlock block;
+    if (!g_thread_buffer) {
+        ensure_initialized();
+        if (!g_thread_buffer && !g_thread_unbuffered) {
+            g_thread_buffer = acquire_thread_buffer();
+            g_thread_unbuffered = !g_thread_buffer;
+        }
+        if (!g_thread_buffer) {
+            std::string chunk = ",\n";
+            chunk.append(entry, size);
+            write_chunk(chunk);
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> lock(g_thread_buffer->mutex);
+    g_thread_buffer->data.append(",\n", 2);
+    g_thread_buffer->data.append(entry, size);
+    if (g_thread_buffer->data.size() >= kThreadBufferBytes) flush_buffer(*g_thread_buffer);
+}
+
+static void write_trace_entry(const std::string& entry) {
+    write_trace_entry(entry.data(), entry.size());
+}
+
+static std::string hex_address(uintptr_t addr) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%llx", static_cast<unsigned long long>(addr));
+    return buf;
+}
+
+static std::string json_escape(const char* str, size_t len) {
+    std::string out;
+    out.reserve(len);
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    return out;
+}
+
+// --- Domain Filters ---
+// COLINTRACE_DOMAINS and COLINTRACE_EXCLUDE_DOMAINS are comma-separated glob
+// lists (fnmatch syntax). They are matched once when a domain is created and
+// the result is stored in the domain's enabled flag, so every override on a
+// disabled domain costs the flag load and branch it already had. A domain
+// switched off through the control channel gets kDomainSwitchedOff instead:
+// bit 0 is clear, so nothing is traced, but begin_task still pushes
+// placeholders so that ends stay matched if the domain is switched on again
+// while one of its tasks is open.
+static constexpr int kDomainSwitchedOff = 2;
+
+static std::vector<std::string> split_list(const char* value) {
+    std::vector<std::string> items;
+    if (!value) return items;
+    std::string item;
+    for (const char* p = value;; ++p) {
+        if (*p == ',' || *p == '\0') {
+            if (!item.empty()) items.push_back(item);
+            item.clear();
+            if (*p == '\0') break;
+        } else if (*p != ' ') {
+            item += *p;
+        }
+    }
+    return items;
+}
+
+static bool matches_any(const std::vector<std::string>& patterns, const char* name) {
+    for (const std::string& pattern : patterns) {
+        if (fnmatch(pattern.c_str(), name, 0) == 0) return true;
+    }
+    return false;
+}
+
+static bool domain_enabled(const char* name) {
+    static const std::vector<std::string> include = split_list(getenv("COLINTRACE_DOMAINS"));
+    static const std::vector<std::string> exclude = split_list(getenv("COLINTRACE_EXCLUDE_DOMAINS"));
+    if (!include.empty() && !matches_any(include, name)) return false;
+    return !matches_any(exclude, name);
+}
+
+// --- Name Filters ---
+// COLINTRACE_NAMES and COLINTRACE_EXCLUDE_NAMES are regular expressions
+// (ECMAScript, unanchored) matched once when a string handle or event is
+// created. Filtered handles carry kNameFiltered in extra1, so a filtered task
+// is dropped before its timestamp is taken.
+static constexpr int kNameFiltered = 1;
+
+static bool compile_name_filter(const char* variable, std::regex& out) {
+    const char* value = getenv(variable);
+    if (!value || !*value) return false;
+    try {
+        out.assign(value, std::regex::ECMAScript | std::regex::optimize);
+        return true;
+    } catch (const std::regex_error& e) {
+        fprintf(stderr, "[colintrace] Ignoring invalid %s: %s\n", variable, e.what());
+        return false;
+    }
+}
+
+static bool name_filtered(const std::string& name) {
+    static std::regex include, exclude;
+    static const bool has_include = compile_name_filter("COLINTRACE_NAMES", include);
+    static const bool has_exclude = compile_name_filter("COLINTRACE_EXCLUDE_NAMES", exclude);
+    if (has_include && !std::regex_search(name, include)) return true;
+    return has_exclude && std::regex_search(name, exclude);
+}
+
+// --- Per-Thread Descriptor ---
+// Resolved on the first event a thread records: caches the kernel tid and
+// writes the thread's name as a "thread_name" metadata event, so trace viewers
+// show names instead of bare tids without repeating them on every event.
+struct ThreadState {
+    long tid = 0;
+    std::string name;
+};
+
+static thread_local ThreadState g_thread;
+
+// The names of live threads and of every track, so that each trace segment
+// can repeat them. Threads are removed by their exit hook. Function-local for
+// the same reason as buffer_pool().
+struct ThreadNames {
+    std::mutex mutex;
+    std::map<long, std::string> names;
+};
+
+static ThreadNames& thread_names() {
+    static ThreadNames* names = new ThreadNames();
+    return *names;
+}
+
+static std::string thread_name_entry(long tid, const std::string& name) {
+    return "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+           ", \"tid\": " + std::to_string(tid) + ", \"args\": {\"name\": \"" + name + "\"}}";
+}
+
+static void write_thread_name(const ThreadState& thread) {
+    {
+        ThreadNames& names = thread_names();
+        std::lock_guard<std::mutex> lock(names.mutex);
+        names.names[thread.tid] = thread.name;
+    }
+    write_trace_entry(thread_name_entry(thread.tid, thread.name));
+}
+
+// Called from the thread exit hook.
+static void forget_thread_name(long tid) {
+    ThreadNames& names = thread_names();
+    std::lock_guard<std::mutex> lock(names.mutex);
+    names.names.erase(tid);
+}
+
+static ThreadState& current_thread() {
+    if (__builtin_expect(g_thread.tid == 0, 0)) {
+        g_thread.tid = syscall(SYS_gettid);
+        if (g_thread.name.empty()) {
+            char comm[17] = {};
+            if (prctl(PR_GET_NAME, comm, 0, 0, 0) == 0 && comm[0]) {
+                g_thread.name = json_escape(comm, strlen(comm));
+            } else {
+                g_thread.name = "thread " + std::to_string(g_thread.tid);
+            }
+        }
+        write_thread_name(g_thread);
+    }
+    return g_thread;
+}
+
+static long current_tid() {
+    return current_thread().tid;
+}
+
+// --- Tracks ---
+// __itt_set_track moves the calling thread's task events onto a virtual track:
+// they are written with the track's virtual tid and nest on the track's own
+// stack instead of the thread's. A track may move between threads, but must
+// not be set on two threads at the same time.
+struct Track {
+    std::string name;
+    long vtid;
+    TaskStack stack;
+};
+
+// Virtual tids start above the largest possible Linux pid (2^22).
+static constexpr long kTrackTidBase = 1L << 30;
+static std::atomic<long> g_next_track_index{0};
+
+static thread_local Track* g_current_track = nullptr;
+
+static TaskStack& task_stack() {
+    return g_current_track ? g_current_track->stack : g_task_stack;
+}
+
+static long event_tid() {
+    return g_current_track ? g_current_track->vtid : current_tid();
+}
+
+// Chrome async events pair "b" and "e" by cat and id, so the id only has to be
+// unique among overlapped tasks that are in flight at the same time.
+static std::string id_to_string(const __itt_id& id) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "0x%llx.%llx.%llx", id.d1, id.d2, id.d3);
+    return buf;
+}
+
+static std::string make_async_entry(const std::string& name, const char* ph, long long ts_us,
+                                    long tid, const std::string& id) {
+    return "{\"name\": \"" + name + "\", \"cat\": \"overlapped\", \"ph\": \"" + ph + "\", \"ts\": " +
+           std::to_string(ts_us) + ", \"pid\": " + std::to_string(getpid()) +
+           ", \"tid\": " + std::to_string(tid) + ", \"id\": \"" + id + "\"}";
+}
+
+// Flow "s" events bind to the slice enclosing their timestamp, so the source
+// end is pulled back by 1us to stay inside the task's [ts, ts + dur] range.
+static long long flow_start_ts(const TaskInstance& inst) {
+    return inst.end_us > inst.begin_us ? inst.end_us - 1 : inst.end_us;
+}
+
+static std::string make_flow_entry(const char* ph, unsigned long long flow_id, long long ts_us, long tid) {
+    std::string entry = "{\"name\": \"relation\", \"cat\": \"flow\", \"ph\": \"" + std::string(ph) +
+                        "\", \"ts\": " + std::to_string(ts_us) + ", \"pid\": " + std::to_string(getpid()) +
+                        ", \"tid\": " + std::to_string(tid) + ", \"id\": " + std::to_string(flow_id);
+    if (ph[0] == 'f') entry += ", \"bp\": \"e\"";
+    return entry + "}";
+}
+
+static void set_instance_begin(TaskInstance& inst, long long ts_us, long tid, std::vector<unsigned long long>& ready) {
+    inst.begin_us = ts_us;
+    inst.begin_tid = tid;
+    ready.swap(inst.pending_in);
+}
+
+// Records the begin of a task with an id. force creates the entry even before
+// the first relation, for the relation calls themselves.
+static void instance_begin(const __itt_id& id, long long ts_us, long tid, bool force) {
+    if (!force && !g_instances_used.load(std::memory_order_relaxed)) return;
+    std::vector<unsigned long long> ready;
+    task_instances().update(id, [&](TaskInstance& inst) { set_instance_begin(inst, ts_us, tid, ready); });
+    for (unsigned long long flow_id : ready) write_trace_entry(make_flow_entry("f", flow_id, ts_us, tid));
+}
+
+static void remember_end(const __itt_id& id, long long flow_ts, long tid) {
+    RecentEndShard& shard = g_recent_ends[IdHash()(id) % kRecentEndShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.ends[shard.next] = {id, flow_ts, tid};
+    shard.next = (shard.next + 1) % kRecentEndsPerShard;
+}
+
+static bool find_recent_end(const __itt_id& id, long long& flow_ts, long& tid) {
+    RecentEndShard& shard = g_recent_ends[IdHash()(id) % kRecentEndShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (size_t n = 0; n < kRecentEndsPerShard; ++n) {
+        const RecentEnd& end = shard.ends[(shard.next + kRecentEndsPerShard - 1 - n) % kRecentEndsPerShard];
+        if (IdEqual()(end.id, id)) {
+            flow_ts = end.flow_ts;
+            tid = end.tid;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Records the end of a task begun at begin_us. A relation added while the
+// task was running may have created its entry after the begin, so the begin
+// is filled in here if it is missing. Unregistered entries are erased, since
+// nothing can be waiting on them any more, and the end goes to the recent
+// ends ring.
+static void instance_end(const __itt_id& id, long long begin_us, long long ts_us, long tid) {
+    long long flow_ts = ts_us > begin_us ? ts_us - 1 : ts_us;
+    if (!g_instances_used.load(std::memory_order_relaxed)) {
+        remember_end(id, flow_ts, tid);
+        return;
+    }
+    std::vector<unsigned long long> ready_in;
+    std::vector<unsigned long long> ready_out;
+    bool registered = false;
+    task_instances().update_existing(id, [&](TaskInstance& inst) {
+        if (inst.begin_us < 0) set_instance_begin(inst, begin_us, tid, ready_in);
+        inst.end_us = ts_us;
+        inst.end_tid = tid;
+        flow_ts = flow_start_ts(inst);
+        ready_out.swap(inst.pending_out);
+        registered = inst.registered;
+        return !registered;
+    });
+    if (!registered) remember_end(id, flow_ts, tid);
+    for (unsigned long long flow_id : ready_in) write_trace_entry(make_flow_entry("f", flow_id, begin_us, tid));
+    for (unsigned long long flow_id : ready_out) write_trace_entry(make_flow_entry("s", flow_id, flow_ts, tid));
+}
+
+static void add_flow(const __itt_id& from, const __itt_id& to) {
+    g_instances_used.store(true, std::memory_order_relaxed);
+    unsigned long long flow_id = g_next_flow_id.fetch_add(1, std::memory_order_relaxed);
+
+    bool from_known = false;
+    bool from_done = false;
+    long long from_ts = 0;
+    long from_tid = 0;
+    task_instances().update_existing(from, [&](TaskInstance& inst) {
+        from_known = true;
+        if (inst.end_us >= 0) {
+            from_done = true;
+            from_ts = flow_start_ts(inst);
+            from_tid = inst.end_tid;
+        } else {
+            inst.pending_out.push_back(flow_id);
+        }
+        return false;
+    });
+    if (!from_known) from_known = from_done = find_recent_end(from, from_ts, from_tid);
+    if (!from_known) return;
+    if (from_done) write_trace_entry(make_flow_entry("s", flow_id, from_ts, from_tid));
+
+    bool to_started = false;
+    long long to_ts = 0;
+    long to_tid = 0;
+    task_instances().update(to, [&](TaskInstance& inst) {
+        if (inst.begin_us >= 0) {
+            to_started = true;
+            to_ts = inst.begin_us;
+            to_tid = inst.begin_tid;
+        } else {
+            inst.pending_in.push_back(flow_id);
+        }
+    });
+    if (to_started) write_trace_entry(make_flow_entry("f", flow_id, to_ts, to_tid));
+}
+
+// "head relation tail" reads as "A is_dependent_on B"; the flow arrow points
+// from whichever side has to happen first.
+static void add_relation(const __itt_id& head, __itt_relation relation, const __itt_id& tail) {
+    if (is_null_id(head) || is_null_id(tail)) return;
+    switch (relation) {
+        case __itt_relation_is_dependent_on:
+        case __itt_relation_is_child_of:
+        case __itt_relation_is_continuation_of:
+            add_flow(tail, head);
+            break;
+        default:
+            add_flow(head, tail);
+            break;
+    }
+}
+
+static std::string task_name(const __itt_domain* domain, const __itt_string_handle* name) {
+    return std::string(domain->nameA) + "::" + std::string(name->strA);
+}
+
+// --- Function Symbolization ---
+// __itt_task_begin_fn tasks only store the function address. Their entries
+// carry a marker (kSymbolMarker and 16 hex digits) in place of the name, and
+// write_chunk replaces the markers of a whole chunk when it leaves the thread
+// buffer, resolving each unique address once. JSON strings never contain a
+// raw control character, so chunks without fn tasks cost one memchr. dlclose
+// flushes the buffers first, so a module's addresses are resolved while it is
+// still mapped. With COLINTRACE_SYMBOLIZE=0 the raw address is written
+// instead and left for an offline step against the colintrace_module records.
+static bool symbolize_enabled() {
+    static const bool enabled = env_ll("COLINTRACE_SYMBOLIZE", 1) != 0;
+    return enabled;
+}
+
+static constexpr char kSymbolMarker = '\x01';
+static constexpr size_t kSymbolMarkerSize = 17;
+static ShardedMap<void*, std::string, AddressHash>& symbol_cache() {
+    static auto* cache = new ShardedMap<void*, std::string, AddressHash>();
+    return *cache;
+}
+
+static std::string resolve_symbol(void* fn) {
+    Dl_info info;
+    if (!symbolize_enabled() || !dladdr(fn, &info)) return hex_address(reinterpret_cast<uintptr_t>(fn));
+    if (info.dli_sname) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+        free(demangled);
+        uintptr_t offset = reinterpret_cast<uintptr_t>(fn) - reinterpret_cast<uintptr_t>(info.dli_saddr);
+        if (offset) name += "+" + std::to_string(offset);
+        return name;
+    }
+    // Static functions have no dynamic symbol: name them by module and offset.
+    const char* module = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+    module = module ? module + 1 : (info.dli_fname ? info.dli_fname : "");
+    return std::string(module) + "+" + hex_address(reinterpret_cast<uintptr_t>(fn) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+}
+
+// dladdr and the demangler run outside the cache's shard lock; two threads
+// missing on the same address both resolve it, to the same name.
+static std::string symbol_name(void* fn) {
+    std::string name;
+    symbol_cache().update_existing(fn, [&](std::string& cached) {
+        name = cached;
+        return false;
+    });
+    if (!name.empty()) return name;
+    std::string resolved = resolve_symbol(fn);
+    name = json_escape(resolved.c_str(), resolved.size());
+    symbol_cache().insert(fn, name);
+    return name;
+}
+
+// Hot path: no lookup, only the marker that write_chunk resolves.
+static std::string task_name(const __itt_domain* domain, const __itt_string_handle* name, void* fn) {
+    if (!fn) return task_name(domain, name);
+    std::string out = std::string(domain->nameA) + "::";
+    if (!symbolize_enabled()) return out + hex_address(reinterpret_cast<uintptr_t>(fn));
+    char marker[kSymbolMarkerSize + 1];
+    snprintf(marker, sizeof(marker), "%c%016llx", kSymbolMarker, static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(fn)));
+    return out.append(marker, kSymbolMarkerSize);
+}
+
+static void resolve_symbol_markers(std::string& chunk) {
+    const char* data = chunk.data();
+    const char* end = data + chunk.size();
+    const char* marker = static_cast<const char*>(memchr(data, kSymbolMarker, chunk.size()));
+    if (!marker) return;
+    HeapHookBlock block;
+    std::string out;
+    out.reserve(chunk.size() + 1024);
+    while (marker && end - marker >= static_cast<ptrdiff_t>(kSymbolMarkerSize)) {
+        out.append(data, marker);
+        char digits[kSymbolMarkerSize] = {};
+        memcpy(digits, marker + 1, kSymbolMarkerSize - 1);
+        out += symbol_name(reinterpret_cast<void*>(static_cast<uintptr_t>(strtoull(digits, nullptr, 16))));
+        data = marker + kSymbolMarkerSize;
+        marker = static_cast<const char*>(memchr(data, kSymbolMarker, end - data));
+    }
+    out.append(data, end);
+    chunk.assign(out);
+}
+
+// --- Metadata Helpers ---
+static size_t metadata_type_size(__itt_metadata_type type) {
+    switch (type) {
+        case __itt_metadata_u64:
+        case __itt_metadata_s64:
+        case __itt_metadata_double: return 8;
+        case __itt_metadata_u32:
+        case __itt_metadata_s32:
+        case __itt_metadata_float: return 4;
+        case __itt_metadata_u16:
+        case __itt_metadata_s16: return 2;
+        default: return 0;
+    }
+}
+
+static double metadata_value(__itt_metadata_type type, const void* p) {
+    switch (type) {
+        case __itt_metadata_u64: { uint64_t v; memcpy(&v, p, 8); return static_cast<double>(v); }
+        case __itt_metadata_s64: { int64_t v; memcpy(&v, p, 8); return static_cast<double>(v); }
+        case __itt_metadata_u32: { uint32_t v; memcpy(&v, p, 4); return v; }
+        case __itt_metadata_s32: { int32_t v; memcpy(&v, p, 4); return v; }
+        case __itt_metadata_u16: { uint16_t v; memcpy(&v, p, 2); return v; }
+        case __itt_metadata_s16: { int16_t v; memcpy(&v, p, 2); return v; }
+        case __itt_metadata_float: { float v; memcpy(&v, p, 4); return v; }
+        case __itt_metadata_double: { double v; memcpy(&v, p, 8); return v; }
+        default: return 0;
+    }
+}
+
+static void append_metadata_value(std::string& out, __itt_metadata_type type, const void* p) {
+    char buf[32];
+    switch (type) {
+        case __itt_metadata_u64: { uint64_t v; memcpy(&v, p, 8); snprintf(buf, sizeof(buf), "%llu", (unsigned long long)v); break; }
+        case __itt_metadata_s64: { int64_t v; memcpy(&v, p, 8); snprintf(buf, sizeof(buf), "%lld", (long long)v); break; }
+        case __itt_metadata_float:
+        case __itt_metadata_double: snprintf(buf, sizeof(buf), "%.17g", metadata_value(type, p)); break;
+        default: snprintf(buf, sizeof(buf), "%.0f", metadata_value(type, p)); break;
+    }
+    out += buf;
+}
+
+static void append_arg(std::string& out, const __itt_string_handle* key, uint8_t type,
+                       uint32_t count, const unsigned char* data) {
+    if (!out.empty()) out += ", ";
+    out += "\"" + json_escape(key->strA, strlen(key->strA)) + "\": ";
+    if (type == TaskArgs::kStringType) {
+        out += "\"" + json_escape(reinterpret_cast<const char*>(data), count) + "\"";
+        return;
+    }
+    __itt_metadata_type mtype = static_cast<__itt_metadata_type>(type);
+    size_t size = metadata_type_size(mtype);
+    if (count == 1) {
+        append_metadata_value(out, mtype, data);
+        return;
+    }
+    out += "[";
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i) out += ", ";
+        append_metadata_value(out, mtype, data + i * size);
+    }
+    out += "]";
+}
+
+static void task_args_add(TaskArgs& args, __itt_string_handle* key, uint8_t type,
+                          uint32_t count, const void* data, size_t data_size) {
+    size_t header_size = (sizeof(TaskArgs::Header) + 7) & ~size_t(7);
+    size_t entry_size = (header_size + data_size + 7) & ~size_t(7);
+    if (args.used + entry_size <= TaskArgs::kCapacity) {
+        TaskArgs::Header header{key, count, type};
+        memcpy(args.bytes + args.used, &header, sizeof(header));
+        memcpy(args.bytes + args.used + header_size, data, data_size);
+        args.used += entry_size;
+        return;
+    }
+    if (!args.overflow) args.overflow.reset(new std::string());
+    append_arg(*args.overflow, key, type, count, static_cast<const unsigned char*>(data));
+}
+
+// Walks the inline entries of args, calling fn(header, data) for each.
+template <typename F>
+static void task_args_for_each(const TaskArgs& args, F&& fn) {
+    size_t header_size = (sizeof(TaskArgs::Header) + 7) & ~size_t(7);
+    size_t offset = 0;
+    while (offset < args.used) {
+        TaskArgs::Header header;
+        memcpy(&header, args.bytes + offset, sizeof(header));
+        const unsigned char* data = args.bytes + offset + header_size;
+        size_t data_size = header.type == TaskArgs::kStringType
+            ? header.count
+            : header.count * metadata_type_size(static_cast<__itt_metadata_type>(header.type));
+        fn(header, data);
+        offset += (header_size + data_size + 7) & ~size_t(7);
+    }
+}
+
+static std::string format_task_args(const TaskArgs& args) {
+    std::string out;
+    task_args_for_each(args, [&](const TaskArgs::Header& header, const unsigned char* data) {
+        append_arg(out, header.key, header.type, header.count, data);
+    });
+    if (args.overflow && !args.overflow->empty()) {
+        if (!out.empty()) out += ", ";
+        out += *args.overflow;
+    }
+    return out;
+}
+
+// --- Throughput Statistics ---
+// Scalar numeric metadata on a task is summed per (domain, task name, key)
+// together with the task durations, giving a value-per-microsecond rate such
+// as bytes/us for a "bytes" key. Like histograms, sums go into a per-thread
+// accumulator whose mutex is only contended at exit; a thread's accumulator
+// is folded into the process totals when the thread exits. Allocated once and
+// never destroyed so that tracer_cleanup can still read it after static
+// destructors have run.
+struct ThroughputStats {
+    unsigned long long tasks = 0;
+    double total = 0;
+    long long total_dur_us = 0;
+};
+
+using ThroughputKey = std::tuple<const __itt_domain*, const __itt_string_handle*, void*, const __itt_string_handle*>;
+using ThroughputMap = std::map<ThroughputKey, ThroughputStats>;
+
+struct ThroughputAccum {
+    std::mutex mutex;
+    ThroughputMap stats;
+};
+
+static std::mutex g_throughput_mutex;
+// Totals from exited threads.
+static ThroughputMap& throughput_totals() {
+    static auto* totals = new ThroughputMap();
+    return *totals;
+}
+static std::vector<ThroughputAccum*>& throughput_accums() {
+    static auto* accums = new std::vector<ThroughputAccum*>();
+    return *accums;
+}
+static thread_local ThroughputAccum* g_thread_throughput = nullptr;
+
+static void merge_throughput(ThroughputMap& into, const ThroughputMap& from) {
+    for (const auto& item : from) {
+        ThroughputStats& stats = into[item.first];
+        stats.tasks += item.second.tasks;
+        stats.total += item.second.total;
+        stats.total_dur_us += item.second.total_dur_us;
+    }
+}
+
+static void record_throughput(const TaskInfo& task, long long duration_us) {
+    ThroughputAccum* accum = g_thread_throughput;
+    if (!accum) {
+        accum = g_thread_throughput = new ThroughputAccum();
+        std::lock_guard<std::mutex> lock(g_throughput_mutex);
+        throughput_accums().push_back(accum);
+    }
+    std::lock_guard<std::mutex> lock(accum->mutex);
+    task_args_for_each(task.args, [&](const TaskArgs::Header& header, const unsigned char* data) {
+        if (header.type == TaskArgs::kStringType || header.count != 1) return;
+        double value = metadata_value(static_cast<__itt_metadata_type>(header.type), data);
+        ThroughputStats& stats = accum->stats[ThroughputKey(task.domain, task.name, task.fn, header.key)];
+        stats.tasks++;
+        stats.total += value;
+        stats.total_dur_us += duration_us;
+    });
+}
+
+// Called from the thread exit hook.
+static void retire_thread_throughput() {
+    ThroughputAccum* accum = g_thread_throughput;
+    if (!accum) return;
+    g_thread_throughput = nullptr;
+    std::lock_guard<std::mutex> lock(g_throughput_mutex);
+    throughput_accums().erase(std::find(throughput_accums().begin(), throughput_accums().end(), accum));
+    merge_throughput(throughput_totals(), accum->stats);
+    delete accum;
+}
+
+static void write_throughput_summary() {
+    std::lock_guard<std::mutex> lock(g_throughput_mutex);
+    ThroughputMap merged = throughput_totals();
+    for (ThroughputAccum* accum : throughput_accums()) {
+        std::lock_guard<std::mutex> accum_lock(accum->mutex);
+        merge_throughput(merged, accum->stats);
+    }
+    for (const auto& item : merged) {
+        const ThroughputStats& stats = item.second;
+        char rate[32];
+        snprintf(rate, sizeof(rate), "%.6g", stats.total_dur_us > 0 ? stats.total / stats.total_dur_us : 0.0);
+        const __itt_string_handle* key = std::get<3>(item.first);
+        std::string entry = "{\"name\": \"colintrace_throughput\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+                            ", \"tid\": 0, \"args\": {\"task\": \"" + task_name(std::get<0>(item.first), std::get<1>(item.first), std::get<2>(item.first)) +
+                            "\", \"key\": \"" + json_escape(key->strA, strlen(key->strA)) +
+                            "\", \"tasks\": " + std::to_string(stats.tasks) + ", \"total\": " + std::to_string(stats.total) +
+                            ", \"total_dur_us\": " + std::to_string(stats.total_dur_us) + ", \"per_us\": " + rate + "}}";
+        write_trace_entry(entry);
+    }
+}
+
+// --- Heap Accounting ---
+// The __itt_heap_* hooks charge allocation counts, bytes and time to the
+// innermost open task. Allocators usually annotate malloc and free themselves,
+// so the hooks return at once while g_heap_hooks_blocked is set and keep their
+// per-thread state in fixed arrays: the common path neither allocates nor
+// takes a lock.
+//
+// With COLINTRACE_HEAP_LIVE_BYTES=1 the size of every live block is also kept
+// in a sharded map, so frees know how many bytes they release and each heap
+// function gets a live_bytes counter track. That costs a shard lock and a map
+// node per allocation, hence opt-in. Threads accumulate live-byte deltas
+// locally and fold them in (emitting a counter sample) every kHeapFlushOps
+// operations and at thread exit.
+struct HeapFunction {
+    std::string name;
+    std::atomic<long long> live_bytes{0};
+};
+
+struct HeapDelta {
+    HeapFunction* function;
+    long long bytes;
+    unsigned ops;
+};
+
+static constexpr unsigned kHeapFlushOps = 1024;
+static constexpr int kHeapDeltaSlots = 8;
+static constexpr int kHeapOpDepth = 8;
+
+static bool heap_live_bytes() {
+    static const bool enabled = env_ll("COLINTRACE_HEAP_LIVE_BYTES", 0) != 0;
+    return enabled;
+}
+
+static std::mutex g_heap_function_mutex;
+static std::map<std::string, HeapFunction*>& heap_function_map() {
+    static auto* map = new std::map<std::string, HeapFunction*>();
+    return *map;
+}
+
+// Sizes of live allocations, only kept with COLINTRACE_HEAP_LIVE_BYTES.
+static ShardedMap<void*, size_t, AddressHash>& heap_allocations() {
+    static auto* allocations = new ShardedMap<void*, size_t, AddressHash>();
+    return *allocations;
+}
+
+static thread_local HeapDelta g_heap_deltas[kHeapDeltaSlots];
+static thread_local int g_heap_delta_count = 0;
+// Start times of the heap operations in progress; nesting beyond
+// kHeapOpDepth is still counted but not timed.
+static thread_local long long g_heap_op_start_ns[kHeapOpDepth];
+static thread_local int g_heap_op_depth = 0;
+
+static long long get_time_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now().time_since_epoch()
+    ).count();
+}
+
+static void flush_heap_delta(HeapDelta& delta) {
+    long long live = delta.function->live_bytes.fetch_add(delta.bytes, std::memory_order_relaxed) + delta.bytes;
+    delta.bytes = 0;
+    delta.ops = 0;
+    char entry[512];
+    int size = snprintf(entry, sizeof(entry),
+                        "{\"name\": \"%s\", \"cat\": \"heap\", \"ph\": \"C\", \"ts\": %lld, \"pid\": %d, \"args\": {\"live_bytes\": %lld}}",
+                        delta.function->name.c_str(), get_time_us(), static_cast<int>(getpid()), live);
+    if (size < 0) return;
+    if (static_cast<size_t>(size) < sizeof(entry)) {
+        write_trace_entry(entry, size);
+    } else {
+        std::string long_entry(size + 1, '\0');
+        snprintf(&long_entry[0], long_entry.size(), "{\"name\": \"%s\", \"cat\": \"heap\", \"ph\": \"C\", \"ts\": %lld, \"pid\": %d, \"args\": {\"live_bytes\": %lld}}",
+                 delta.function->name.c_str(), get_time_us(), static_cast<int>(getpid()), live);
+        long_entry.resize(size);
+        write_trace_entry(long_entry);
+    }
+}
+
+// Called every kHeapFlushOps operations per function and from the thread exit hook.
+static void flush_heap_deltas() {
+    for (int i = 0; i < g_heap_delta_count; ++i) {
+        if (g_heap_deltas[i].ops) flush_heap_delta(g_heap_deltas[i]);
+    }
+}
+
+static void record_heap_delta(HeapFunction* function, long long bytes) {
+    HeapDelta* delta = nullptr;
+    for (int i = 0; i < g_heap_delta_count; ++i) {
+        if (g_heap_deltas[i].function == function) {
+            delta = &g_heap_deltas[i];
+            break;
+        }
+    }
+    if (!delta) {
+        if (g_heap_delta_count == kHeapDeltaSlots) {
+            // More heap functions than slots on this thread: apply directly.
+            function->live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            return;
+        }
+        delta = &g_heap_deltas[g_heap_delta_count++];
+        *delta = {function, 0, 0};
+    }
+    delta->bytes += bytes;
+    if (++delta->ops >= kHeapFlushOps) flush_heap_delta(*delta);
+}
+
+static void heap_op_begin() {
+    if (g_heap_op_depth < kHeapOpDepth) g_heap_op_start_ns[g_heap_op_depth] = get_time_ns();
+    ++g_heap_op_depth;
+}
+
+// Returns the time since the matching heap_op_begin, or 0 if unbalanced.
+static unsigned long long heap_op_end() {
+    if (g_heap_op_depth == 0) return 0;
+    if (--g_heap_op_depth >= kHeapOpDepth) return 0;
+    return static_cast<unsigned long long>(get_time_ns() - g_heap_op_start_ns[g_heap_op_depth]);
+}
+
+// Forgets the start time of an operation that straddles a pause boundary.
+static void heap_op_discard() {
+    if (!detached() && g_heap_op_depth > 0) --g_heap_op_depth;
+}
+
+static void heap_record_alloc(HeapFunction* function, void* addr, size_t size, unsigned long long elapsed_ns) {
+    TaskStack& stack = task_stack();
+    if (!stack.empty()) {
+        HeapCounters& heap = stack.back().heap;
+        heap.allocs++;
+        heap.alloc_bytes += size;
+        heap.heap_ns += elapsed_ns;
+    }
+    if (!addr || !heap_live_bytes()) return;
+    heap_allocations().insert(addr, size);
+    record_heap_delta(function, static_cast<long long>(size));
+}
+
+static void heap_record_free(HeapFunction* function, void* addr, unsigned long long elapsed_ns) {
+    size_t size = 0;
+    bool known = addr && heap_live_bytes() && heap_allocations().take(addr, size);
+    TaskStack& stack = task_stack();
+    if (!stack.empty()) {
+        HeapCounters& heap = stack.back().heap;
+        heap.frees++;
+        heap.freed_bytes += size;
+        heap.heap_ns += elapsed_ns;
+    }
+    if (known) record_heap_delta(function, -static_cast<long long>(size));
+}
+
+static void append_heap_args(std::string& out, const HeapCounters& heap) {
+    if (!out.empty()) out += ", ";
+    out += "\"heap_allocs\": " + std::to_string(heap.allocs) + ", \"heap_alloc_bytes\": " + std::to_string(heap.alloc_bytes) +
+           ", \"heap_frees\": " + std::to_string(heap.frees) + ", \"heap_freed_bytes\": " + std::to_string(heap.freed_bytes) +
+           ", \"heap_ns\": " + std::to_string(heap.heap_ns);
+}
+
+// --- Per-Name Statistics ---
+// One NameStats per task name (string handle, via its extra2 word) or per
+// __itt_task_begin_fn address, created on first use and never freed. Holds
+// the counters for dropped short tasks and the governor's per-name state.
+struct NameStats {
+    const __itt_string_handle* name = nullptr;
+    void* fn = nullptr;
+    alignas(64) std::atomic<unsigned long long> dropped{0};
+    std::atomic<unsigned long long> dropped_us{0};
+    std::atomic<unsigned long long> tasks{0};        // begun while governed
+    std::atomic<unsigned> sample_period{1};          // set by the governor
+    unsigned long long governor_tasks = 0;           // governor thread only
+};
+
+static std::mutex g_name_stats_mutex;
+static std::vector<NameStats*>& name_stats_list() {
+    static auto* list = new std::vector<NameStats*>();
+    return *list;
+}
+static ShardedMap<void*, NameStats*, AddressHash>& fn_stats() {
+    static auto* stats = new ShardedMap<void*, NameStats*, AddressHash>();
+    return *stats;
+}
+
+// The caller holds g_name_stats_mutex.
+static NameStats* new_name_stats(const __itt_string_handle* name, void* fn) {
+    NameStats* stats = new NameStats();
+    stats->name = name;
+    stats->fn = fn;
+    name_stats_list().push_back(stats);
+    return stats;
+}
+
+static NameStats* name_stats(__itt_string_handle* name, void* fn) {
+    NameStats* stats = nullptr;
+    if (fn) {
+        fn_stats().update(fn, [&](NameStats*& entry) {
+            if (!entry) {
+                std::lock_guard<std::mutex> lock(g_name_stats_mutex);
+                entry = new_name_stats(nullptr, fn);
+            }
+            stats = entry;
+        });
+        return stats;
+    }
+    stats = static_cast<NameStats*>(__atomic_load_n(&name->extra2, __ATOMIC_ACQUIRE));
+    if (stats) return stats;
+    std::lock_guard<std::mutex> lock(g_name_stats_mutex);
+    stats = static_cast<NameStats*>(name->extra2);
+    if (!stats) {
+        stats = new_name_stats(name, nullptr);
+        __atomic_store_n(&name->extra2, stats, __ATOMIC_RELEASE);
+    }
+    return stats;
+}
+
+static std::string stats_name(const NameStats& stats) {
+    return stats.fn ? symbol_name(stats.fn) : json_escape(stats.name->strA, strlen(stats.name->strA));
+}
+
+// --- Minimum Duration ---
+// COLINTRACE_MIN_DURATION_US is a comma-separated list of a global threshold
+// and per-domain overrides, e.g. "5,app.*=0,tbb=50"; the first matching glob
+// wins. The threshold is resolved when the domain is created and kept in its
+// extra1 word. A task ending sooner than its domain's threshold is dropped
+// right after the end timestamp is taken, before any formatting, and only
+// counted (per name) in a colintrace_dropped record written at exit. Tasks
+// with an id are always written because relations may refer to them.
+static int min_duration_for(const char* domain) {
+    static const std::vector<std::string> rules = split_list(getenv("COLINTRACE_MIN_DURATION_US"));
+    long long threshold = 0;
+    for (const std::string& rule : rules) {
+        size_t eq = rule.find('=');
+        if (eq == std::string::npos) {
+            threshold = atoll(rule.c_str());
+        } else if (fnmatch(rule.substr(0, eq).c_str(), domain, 0) == 0) {
+            threshold = atoll(rule.c_str() + eq + 1);
+            break;
+        }
+    }
+    return static_cast<int>(std::max(0LL, std::min<long long>(threshold, std::numeric_limits<int>::max())));
+}
+
+// Dropped tasks are counted per thread, keyed by string handle or function
+// address, and added to their NameStats when the thread exits or the trace is
+// finalized, so a hot short task touches no shared counter or sharded map.
+struct DroppedCount {
+    __itt_string_handle* name = nullptr;
+    void* fn = nullptr;
+    unsigned long long count = 0;
+    unsigned long long total_us = 0;
+};
+
+struct DroppedAccum {
+    std::mutex mutex; // uncontended except when folded at finalize
+    std::unordered_map<const void*, DroppedCount> counts;
+};
+
+static std::mutex g_dropped_mutex;
+static std::vector<DroppedAccum*>& dropped_accums() {
+    static auto* accums = new std::vector<DroppedAccum*>();
+    return *accums;
+}
+static thread_local DroppedAccum* g_thread_dropped = nullptr;
+
+// The caller holds accum.mutex, or has taken accum out of dropped_accums().
+static void fold_dropped(DroppedAccum& accum) {
+    for (const auto& item : accum.counts) {
+        NameStats* stats = name_stats(item.second.name, item.second.fn);
+        stats->dropped.fetch_add(item.second.count, std::memory_order_relaxed);
+        stats->dropped_us.fetch_add(item.second.total_us, std::memory_order_relaxed);
+    }
+    accum.counts.clear();
+}
+
+static void record_dropped(TaskInfo& task, long long duration_us) {
+    DroppedAccum* accum = g_thread_dropped;
+    if (!accum) {
+        accum = g_thread_dropped = new DroppedAccum();
+        std::lock_guard<std::mutex> lock(g_dropped_mutex);
+        dropped_accums().push_back(accum);
+    }
+    {
+        std::lock_guard<std::mutex> lock(accum->mutex);
+        DroppedCount& count = accum->counts[task.fn ? task.fn : static_cast<const void*>(task.name)];
+        count.name = task.name;
+        count.fn = task.fn;
+        count.count++;
+        count.total_us += duration_us;
+    }
+    if (task.args.used) record_throughput(task, duration_us);
+}
+
+// Called from the thread exit hook.
+static void retire_thread_dropped() {
+    DroppedAccum* accum = g_thread_dropped;
+    if (!accum) return;
+    g_thread_dropped = nullptr;
+    std::lock_guard<std::mutex> lock(g_dropped_mutex);
+    dropped_accums().erase(std::find(dropped_accums().begin(), dropped_accums().end(), accum));
+    fold_dropped(*accum);
+    delete accum;
+}
+
+static void write_dropped_summary() {
+    {
+        std::lock_guard<std::mutex> lock(g_dropped_mutex);
+        for (DroppedAccum* accum : dropped_accums()) {
+            std::lock_guard<std::mutex> accum_lock(accum->mutex);
+            fold_dropped(*accum);
+        }
+    }
+    std::lock_guard<std::mutex> lock(g_name_stats_mutex);
+    for (const NameStats* stats : name_stats_list()) {
+        if (!stats->dropped.load()) continue;
+        std::string entry = "{\"name\": \"colintrace_dropped\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+                            ", \"tid\": 0, \"args\": {\"task\": \"" + stats_name(*stats) +
+                            "\", \"count\": " + std::to_string(stats->dropped.load()) +
+                            ", \"total_dur_us\": " + std::to_string(stats->dropped_us.load()) + "}}";
+        write_trace_entry(entry);
+    }
+}
+
+// --- Overhead Governor ---
+// With COLINTRACE_OVERHEAD_BUDGET=<percent> the task begin/end paths time
+// themselves and a governor thread compares that time with the process CPU
+// time every COLINTRACE_GOVERNOR_INTERVAL_MS. Over budget, it doubles the
+// sample period of the name that wrote the most tasks in the interval; under
+// half the budget, it halves the largest period again. Each decision is
+// written as a colintrace_governor record. Tracer time is summed in sharded
+// counters so threads do not share a cache line, and per-name task counts
+// are batched per thread (see governor_skips).
+struct alignas(64) OverheadShard {
+    std::atomic<unsigned long long> ns{0};
+};
+
+static constexpr size_t kOverheadShards = 64;
+static constexpr unsigned kMaxSamplePeriod = 1u << 16;
+static bool g_governed = false; // set once in tracer_init
+static OverheadShard g_overhead[kOverheadShards];
+static std::atomic<unsigned> g_next_overhead_shard{0};
+static thread_local unsigned g_overhead_shard = 0; // shard index + 1
+
+// Adds the time spent in the enclosing tracer call to the thread's shard.
+// Calls that are not collecting pass active = false and read no clock.
+struct OverheadScope {
+    long long start_ns = 0;
+    explicit OverheadScope(bool active) {
+        if (active && g_governed) start_ns = get_time_ns();
+    }
+    ~OverheadScope() {
+        if (!start_ns) return;
+        if (!g_overhead_shard) g_overhead_shard = g_next_overhead_shard++ % kOverheadShards + 1;
+        g_overhead[g_overhead_shard - 1].ns.fetch_add(get_time_ns() - start_ns, std::memory_order_relaxed);
+    }
+};
+
+// Each thread counts begun tasks in a small direct-mapped table of names and
+// adds them to the shared NameStats::tasks every kGovernorBatch tasks, when
+// the slot is taken by another name, or at thread exit. The governor only
+// needs the per-interval totals, so a name's count lagging by a batch per
+// thread does not change its decisions.
+struct GovernorSlot {
+    NameStats* stats;
+    unsigned long long tick; // this thread's tasks of the name, for sampling
+    unsigned pending;        // not yet added to stats->tasks
+};
+
+static constexpr size_t kGovernorSlots = 64;
+static constexpr unsigned kGovernorBatch = 64;
+static thread_local GovernorSlot g_governor_slots[kGovernorSlots];
+
+static void flush_governor_slot(GovernorSlot& slot) {
+    if (slot.pending) slot.stats->tasks.fetch_add(slot.pending, std::memory_order_relaxed);
+    slot.pending = 0;
+}
+
+// Called from the thread exit hook.
+static void flush_governor_slots() {
+    for (GovernorSlot& slot : g_governor_slots) flush_governor_slot(slot);
+}
+
+// Per-name sampling for a task about to begin; only called while governed.
+static bool governor_skips(__itt_string_handle* name) {
+    NameStats* stats = name_stats(name, nullptr);
+    GovernorSlot& slot = g_governor_slots[AddressHash()(stats) % kGovernorSlots];
+    if (slot.stats != stats) {
+        flush_governor_slot(slot);
+        slot = {stats, 0, 0};
+    }
+    if (++slot.pending == kGovernorBatch) flush_governor_slot(slot);
+    unsigned period = stats->sample_period.load(std::memory_order_relaxed);
+    return period > 1 && slot.tick++ % period != 0;
+}
+
+static void write_governor_decision(const NameStats& stats, const char* action, unsigned period, double overhead_pct) {
+    char pct[32];
+    snprintf(pct, sizeof(pct), "%.3f", overhead_pct);
+    std::string entry = "{\"name\": \"colintrace_governor\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+                        ", \"tid\": 0, \"args\": {\"time_us\": " + std::to_string(get_time_us()) + ", \"action\": \"" + action +
+                        "\", \"task\": \"" + stats_name(stats) + "\", \"sample_period\": " + std::to_string(period) +
+                        ", \"overhead_pct\": " + pct + "}}";
+    write_trace_entry(entry);
+}
+
+static long long process_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void governor_step(double budget_pct, long long cpu_ns) {
+    unsigned long long overhead_ns = 0;
+    for (OverheadShard& shard : g_overhead) overhead_ns += shard.ns.exchange(0, std::memory_order_relaxed);
+    if (cpu_ns <= 0 || !collecting()) return;
+    double overhead_pct = 100.0 * overhead_ns / cpu_ns;
+
+    std::lock_guard<std::mutex> lock(g_name_stats_mutex);
+    NameStats* busiest = nullptr;
+    unsigned long long busiest_tasks = 0;
+    NameStats* throttled = nullptr;
+    for (NameStats* stats : name_stats_list()) {
+        unsigned long long tasks = stats->tasks.load(std::memory_order_relaxed);
+        unsigned period = stats->sample_period.load(std::memory_order_relaxed);
+        unsigned long long written = (tasks - stats->governor_tasks) / period;
+        stats->governor_tasks = tasks;
+        if (period < kMaxSamplePeriod && written > busiest_tasks) {
+            busiest = stats;
+            busiest_tasks = written;
+        }
+        if (period > 1 && (!throttled || period > throttled->sample_period.load(std::memory_order_relaxed))) {
+            throttled = stats;
+        }
+    }
+    if (overhead_pct > budget_pct && busiest) {
+        unsigned period = busiest->sample_period.load(std::memory_order_relaxed) * 2;
+        busiest->sample_period.store(period, std::memory_order_relaxed);
+        write_governor_decision(*busiest, "raise", period, overhead_pct);
+    } else if (overhead_pct < budget_pct / 2 && throttled) {
+        unsigned period = throttled->sample_period.load(std::memory_order_relaxed) / 2;
+        throttled->sample_period.store(period, std::memory_order_relaxed);
+        write_governor_decision(*throttled, "relax", period, overhead_pct);
+    }
+}
+
+static void governor_loop(double budget_pct, long long interval_ms) {
+    prctl(PR_SET_NAME, "colintrace-gov", 0, 0, 0);
+    long long last_cpu_ns = process_cpu_ns();
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        if (detached()) return;
+        long long cpu_ns = process_cpu_ns();
+        governor_step(budget_pct, cpu_ns - last_cpu_ns);
+        last_cpu_ns = cpu_ns;
+    }
+}
+
+static void start_governor() {
+    const char* budget = getenv("COLINTRACE_OVERHEAD_BUDGET");
+    double budget_pct = budget ? atof(budget) : 0.0;
+    if (budget_pct <= 0) return;
+    long long interval_ms = std::max(10LL, env_ll("COLINTRACE_GOVERNOR_INTERVAL_MS", 1000));
+    g_governed = true;
+    std::thread(governor_loop, budget_pct, interval_ms).detach();
+    fprintf(stderr, "[colintrace] Overhead governor on, budget %g%% of CPU time\n", budget_pct);
+}
+
+// --- Thread Exit Hook ---
+// Armed on a thread's first pushed task frame, started event or trace entry;
+// the destructor is with the event functions below. Thread-local destructors
+// run in reverse order of construction, so the state the hook reads is
+// touched before the hook itself is constructed.
+struct ThreadExitHook {
+    bool armed = false;
+    ~ThreadExitHook();
+};
+
+static thread_local ThreadExitHook g_thread_exit_hook;
+static thread_local bool g_thread_exit_hook_armed = false; // trivial, so checking it costs no TLS init call
+
+static void arm_thread_exit_hook() {
+    if (g_thread_exit_hook_armed) return;
+    g_thread_exit_hook_armed = true;
+    (void)g_task_stack.size();
+    (void)g_event_start_times.size();
+    (void)g_thread.tid;
+    g_thread_exit_hook.armed = true;
+}
+
+// --- Sync Object Contention ---
+// Each annotated lock gets a SyncObject with wait (prepare -> acquired) and hold
+// (acquired -> releasing) totals. Threads keep their in-progress prepares and
+// holds locally, so the shared object is only touched with relaxed atomics once
+// a wait or hold completes.
+//
+// Objects are retired by __itt_sync_destroy and __itt_sync_rename (which may
+// happen while another thread waits on or holds the lock): the address is
+// unmapped and the object moves to the retired list, where it stays alive
+// because other threads' pending waits and holds, and their lookup caches,
+// may still point to it. The contention report sums retired objects per
+// name. Each thread caches address -> object lookups; any retirement bumps
+// g_sync_generation, which invalidates every cache at once, so the hot path
+// only takes a shard lock on a miss.
+struct SyncObject {
+    std::string name;
+    std::atomic<unsigned long long> waits{0};
+    std::atomic<unsigned long long> total_wait_ns{0};
+    std::atomic<unsigned long long> max_wait_ns{0};
+    std::atomic<unsigned long long> acquisitions{0};
+    std::atomic<unsigned long long> total_hold_ns{0};
+    std::atomic<unsigned long long> max_hold_ns{0};
+};
+
+struct SyncPending {
+    void* addr;
+    SyncObject* object;
+    long long start_ns;
+};
+
+// Waits shorter than this are folded into the statistics but not written as
+// events, which keeps uncontended locks from flooding the trace.
+static long long sync_wait_threshold_ns() {
+    static const long long threshold = env_ll("COLINTRACE_SYNC_WAIT_THRESHOLD_US", 0) * 1000;
+    return threshold;
+}
+
+struct SyncCacheEntry {
+    void* addr;
+    SyncObject* object;
+    unsigned long long generation;
+};
+
+static constexpr size_t kSyncCacheSize = 64;
+
+static ShardedMap<void*, SyncObject*, AddressHash>& sync_objects() {
+    static auto* objects = new ShardedMap<void*, SyncObject*, AddressHash>();
+    return *objects;
+}
+
+static std::mutex g_sync_registry_mutex;
+// Live objects.
+static std::unordered_set<SyncObject*>& sync_registry() {
+    static auto* registry = new std::unordered_set<SyncObject*>();
+    return *registry;
+}
+// Destroyed or renamed objects, never freed.
+static std::vector<SyncObject*>& sync_retired() {
+    static auto* retired = new std::vector<SyncObject*>();
+    return *retired;
+}
+static std::atomic<unsigned long long> g_sync_generation{1};
+
+static thread_local std::vector<SyncPending> g_sync_prepares;
+static thread_local std::vector<SyncPending> g_sync_holds;
+static thread_local SyncCacheEntry g_sync_cache[kSyncCacheSize];
+
+static SyncObject* new_sync_object(void* addr, const char* name) {
+    SyncObject* object = new SyncObject();
+    if (name && *name) {
+        object->name = json_escape(name, strlen(name));
+    } else {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "sync@%p", addr);
+        object->name = buf;
+    }
+    std::lock_guard<std::mutex> lock(g_sync_registry_mutex);
+    sync_registry().insert(object);
+    return object;
+}
+
+static void atomic_max(std::atomic<unsigned long long>& target, unsigned long long value) {
+    unsigned long long current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+}
+
+// The object is no longer reachable from sync_objects(), but pending waits,
+// holds and caches of other threads may still update it.
+static void retire_sync_object(SyncObject* object) {
+    g_sync_generation.fetch_add(1, std::memory_order_acq_rel);
+    std::lock_guard<std::mutex> lock(g_sync_registry_mutex);
+    sync_registry().erase(object);
+    sync_retired().push_back(object);
+}
+
+// Maps addr to object, retiring whatever object it had before.
+static void set_sync_object(void* addr, SyncObject* object) {
+    SyncObject* previous = nullptr;
+    sync_objects().update(addr, [&](SyncObject*& slot) {
+        previous = slot;
+        slot = object;
+    });
+    if (previous) retire_sync_object(previous);
+}
+
+// Locks annotated without __itt_sync_create get an address-named object on first use.
+static SyncObject* find_sync_object(void* addr) {
+    SyncCacheEntry& cached = g_sync_cache[AddressHash()(addr) % kSyncCacheSize];
+    unsigned long long generation = g_sync_generation.load(std::memory_order_acquire);
+    if (cached.addr == addr && cached.generation == generation) return cached.object;
+    SyncObject* object = nullptr;
+    sync_objects().update(addr, [&](SyncObject*& slot) {
+        if (!slot) slot = new_sync_object(addr, nullptr);
+        object = slot;
+    });
+    cached = {addr, object, generation};
+    return object;
+}
+
+static bool take_sync_pending(std::vector<SyncPending>& pending, void* addr, SyncPending& out) {
+    for (size_t i = pending.size(); i-- > 0;) {
+        if (pending[i].addr == addr) {
+            out = pending[i];
+            pending.erase(pending.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void write_contention_report() {
+    std::lock_guard<std::mutex> lock(g_sync_registry_mutex);
+    std::vector<SyncObject*> objects(sync_registry().begin(), sync_registry().end());
+    std::map<std::string, SyncObject> retired; // per-name totals
+    for (SyncObject* object : sync_retired()) {
+        if (!object->waits.load() && !object->acquisitions.load()) continue;
+        SyncObject& total = retired[object->name];
+        total.name = object->name;
+        total.waits += object->waits.load();
+        total.total_wait_ns += object->total_wait_ns.load();
+        atomic_max(total.max_wait_ns, object->max_wait_ns.load());
+        total.acquisitions += object->acquisitions.load();
+        total.total_hold_ns += object->total_hold_ns.load();
+        atomic_max(total.max_hold_ns, object->max_hold_ns.load());
+    }
+    for (auto& item : retired) objects.push_back(&item.second);
+    objects.erase(std::remove_if(objects.begin(), objects.end(), [](SyncObject* o) {
+        return o->acquisitions.load() == 0 && o->waits.load() == 0;
+    }), objects.end());
+    if (objects.empty()) return;
+    std::sort(objects.begin(), objects.end(), [](SyncObject* a, SyncObject* b) {
+        return a->total_wait_ns.load() > b->total_wait_ns.load();
+    });
+
+    fprintf(stderr, "[colintrace] Lock contention (by total wait):\n");
+    for (size_t rank = 0; rank < objects.size(); ++rank) {
+        SyncObject* o = objects[rank];
+        std::string entry = "{\"name\": \"colintrace_contention\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+                            ", \"tid\": 0, \"args\": {\"rank\": " + std::to_string(rank + 1) + ", \"sync\": \"" + o->name +
+                            "\", \"waits\": " + std::to_string(o->waits.load()) +
+                            ", \"total_wait_ns\": " + std::to_string(o->total_wait_ns.load()) +
+                            ", \"max_wait_ns\": " + std::to_string(o->max_wait_ns.load()) +
+                            ", \"acquisitions\": " + std::to_string(o->acquisitions.load()) +
+                            ", \"total_hold_ns\": " + std::to_string(o->total_hold_ns.load()) +
+                            ", \"max_hold_ns\": " + std::to_string(o->max_hold_ns.load()) + "}}";
+        write_trace_entry(entry);
+        if (rank < 10) {
+            fprintf(stderr, "[colintrace]   %zu. %s: wait %lluus over %llu waits, hold %lluus\n", rank + 1, o->name.c_str(),
+                    o->total_wait_ns.load() / 1000, o->waits.load(), o->total_hold_ns.load() / 1000);
+        }
+    }
+}
+
+// --- Histograms ---
+// Submissions are binned into per-thread accumulators, so submitting threads
+// never contend with each other; the accumulators are owned by the histogram
+// (not the thread) and merged into one summary record at exit.
+//
+// Values with an x axis are binned by sign and power of two: the bucket comes
+// straight from the IEEE-754 exponent of the value, clamped to 2^-64..2^63.
+// Histograms submitted without x data use the array index as the bin.
+static constexpr size_t kHistogramBlock = 256;
+static constexpr int kHistogramLog2Buckets = 128;
+static constexpr int kHistogramLog2Min = -64;
+
+struct HistogramAccum {
+    std::mutex mutex; // uncontended except when merged at exit
+    double count = 0;
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    double buckets[2 * kHistogramLog2Buckets] = {}; // positive half, then negative half
+    std::vector<double> by_index;
+};
+
+struct HistogramState {
+    std::string domain;
+    std::string name;
+    std::mutex mutex;
+    std::vector<HistogramAccum*> accums;
+};
+
+static std::mutex g_histogram_mutex;
+static std::map<std::pair<const __itt_domain*, std::string>, __itt_histogram*>& histograms() {
+    static auto* map = new std::map<std::pair<const __itt_domain*, std::string>, __itt_histogram*>();
+    return *map;
+}
+
+static thread_local std::vector<std::pair<HistogramState*, HistogramAccum*>> g_histogram_accums;
+
+static HistogramAccum* thread_histogram_accum(HistogramState* state) {
+    for (auto& item : g_histogram_accums) {
+        if (item.first == state) return item.second;
+    }
+    HistogramAccum* accum = new HistogramAccum();
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->accums.push_back(accum);
+    }
+    g_histogram_accums.emplace_back(state, accum);
+    return accum;
+}
+
+// The widening and bucket index loops below rely on auto-vectorization, which
+// GCC applies to both only at -O3; the rest of the library keeps the build's
+// optimization level.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("O3")
+#endif
+
+template <typename T>
+static void convert_block(const void* data, size_t offset, size_t n, double* out) {
+    const T* src = static_cast<const T*>(data) + offset;
+    for (size_t i = 0; i < n; ++i) out[i] = static_cast<double>(src[i]);
+}
+
+// Widens n elements starting at offset to double. Returns false for types that
+// cannot be binned.
+static bool convert_metadata_block(__itt_metadata_type type, const void* data, size_t offset, size_t n, double* out) {
+    switch (type) {
+        case __itt_metadata_u64: convert_block<uint64_t>(data, offset, n, out); return true;
+        case __itt_metadata_s64: convert_block<int64_t>(data, offset, n, out); return true;
+        case __itt_metadata_u32: convert_block<uint32_t>(data, offset, n, out); return true;
+        case __itt_metadata_s32: convert_block<int32_t>(data, offset, n, out); return true;
+        case __itt_metadata_u16: convert_block<uint16_t>(data, offset, n, out); return true;
+        case __itt_metadata_s16: convert_block<int16_t>(data, offset, n, out); return true;
+        case __itt_metadata_float: convert_block<float>(data, offset, n, out); return true;
+        case __itt_metadata_double: convert_block<double>(data, offset, n, out); return true;
+        default: return false;
+    }
+}
+
+// Four reduction lanes held in two 128-bit vectors (SSE2 on x86-64, NEON on
+// AArch64). Written with vector types rather than left to the vectorizer:
+// at -O3 GCC fully unrolls a four-lane loop first and then emits scalar
+// min/max.
+typedef double Double2 __attribute__((vector_size(16)));
+
+// Bins one block of values with weights. The count/sum/min/max reduction is
+// explicit SIMD; the widening in convert_block and the bucket index loop,
+// which uses shifts and masks only, are auto-vectorized; the 64-bit integer
+// widenings stay scalar on x86-64 without AVX-512. Only the final scatter
+// into buckets is scalar.
+static void bin_histogram_block(HistogramAccum& accum, const double* x, const double* w, size_t n) {
+    Double2 count[2] = {};
+    Double2 sum[2] = {};
+    Double2 lo[2] = {{accum.min, accum.min}, {accum.min, accum.min}};
+    Double2 hi[2] = {{accum.max, accum.max}, {accum.max, accum.max}};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int half = 0; half < 2; ++half) {
+            Double2 v, wv;
+            memcpy(&v, x + i + 2 * half, sizeof(v));
+            memcpy(&wv, w + i + 2 * half, sizeof(wv));
+            count[half] += wv;
+            sum[half] += v * wv;
+            lo[half] = v < lo[half] ? v : lo[half];
+            hi[half] = v > hi[half] ? v : hi[half];
+        }
+    }
+    for (; i < n; ++i) {
+        count[0][0] += w[i];
+        sum[0][0] += x[i] * w[i];
+        lo[0][0] = x[i] < lo[0][0] ? x[i] : lo[0][0];
+        hi[0][0] = x[i] > hi[0][0] ? x[i] : hi[0][0];
+    }
+    accum.count += (count[0][0] + count[0][1]) + (count[1][0] + count[1][1]);
+    accum.sum += (sum[0][0] + sum[0][1]) + (sum[1][0] + sum[1][1]);
+    accum.min = std::min(std::min(lo[0][0], lo[0][1]), std::min(lo[1][0], lo[1][1]));
+    accum.max = std::max(std::max(hi[0][0], hi[0][1]), std::max(hi[1][0], hi[1][1]));
+
+    uint32_t index[kHistogramBlock];
+    for (i = 0; i < n; ++i) {
+        uint64_t bits;
+        memcpy(&bits, &x[i], sizeof(bits));
+        int64_t exponent = static_cast<int64_t>((bits >> 52) & 0x7ff) - 1023 - kHistogramLog2Min;
+        exponent = exponent < 0 ? 0 : exponent;
+        exponent = exponent > kHistogramLog2Buckets - 1 ? kHistogramLog2Buckets - 1 : exponent;
+        index[i] = static_cast<uint32_t>((bits >> 63) * kHistogramLog2Buckets + exponent);
+    }
+    for (i = 0; i < n; ++i) accum.buckets[index[i]] += w[i];
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+static void submit_histogram(HistogramAccum& accum, const __itt_histogram* hist, size_t length,
+                             const void* x_data, const void* y_data) {
+    double x[kHistogramBlock];
+    double w[kHistogramBlock];
+    std::lock_guard<std::mutex> lock(accum.mutex);
+    if (!x_data) {
+        // Indexed histogram: y_data[i] is the value of bin i.
+        if (accum.by_index.size() < length) accum.by_index.resize(length, 0.0);
+        for (size_t offset = 0; offset < length; offset += kHistogramBlock) {
+            size_t n = std::min(kHistogramBlock, length - offset);
+            if (!convert_metadata_block(hist->y_type, y_data, offset, n, w)) return;
+            double* bins = accum.by_index.data() + offset;
+            for (size_t i = 0; i < n; ++i) bins[i] += w[i];
+        }
+        return;
+    }
+    for (size_t offset = 0; offset < length; offset += kHistogramBlock) {
+        size_t n = std::min(kHistogramBlock, length - offset);
+        if (!convert_metadata_block(hist->x_type, x_data, offset, n, x)) return;
+        if (!y_data) {
+            std::fill(w, w + n, 1.0);
+        } else if (!convert_metadata_block(hist->y_type, y_data, offset, n, w)) {
+            return;
+        }
+        bin_histogram_block(accum, x, w, n);
+    }
+}
+
+static std::string format_double(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.10g", value);
+    return buf;
+}
+
+// One record per histogram. "log2_buckets" lists [lower, weight] for the
+// non-empty buckets: lower 2^k covers [2^k, 2^(k+1)), -2^k covers
+// (-2^(k+1), -2^k], and the lowest bucket also holds zero.
+static void write_histogram_summary() {
+    std::lock_guard<std::mutex> lock(g_histogram_mutex);
+    for (const auto& item : histograms()) {
+        HistogramState* state = static_cast<HistogramState*>(item.second->extra2);
+        HistogramAccum merged;
+        {
+            std::lock_guard<std::mutex> state_lock(state->mutex);
+            for (HistogramAccum* accum : state->accums) {
+                std::lock_guard<std::mutex> accum_lock(accum->mutex);
+                merged.count += accum->count;
+                merged.sum += accum->sum;
+                merged.min = std::min(merged.min, accum->min);
+                merged.max = std::max(merged.max, accum->max);
+                for (int b = 0; b < 2 * kHistogramLog2Buckets; ++b) merged.buckets[b] += accum->buckets[b];
+                if (merged.by_index.size() < accum->by_index.size()) merged.by_index.resize(accum->by_index.size(), 0.0);
+                for (size_t i = 0; i < accum->by_index.size(); ++i) merged.by_index[i] += accum->by_index[i];
+            }
+        }
+        if (merged.count == 0 && merged.by_index.empty()) continue;
+
+        std::string entry = "{\"name\": \"colintrace_histogram\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+                            ", \"tid\": 0, \"args\": {\"histogram\": \"" + state->domain + "::" + state->name + "\"";
+        if (merged.count > 0) {
+            entry += ", \"count\": " + format_double(merged.count) + ", \"sum\": " + format_double(merged.sum) +
+                     ", \"mean\": " + format_double(merged.sum / merged.count) + ", \"min\": " + format_double(merged.min) +
+                     ", \"max\": " + format_double(merged.max) + ", \"log2_buckets\": [";
+            bool first = true;
+            for (int b = 0; b < 2 * kHistogramLog2Buckets; ++b) {
+                if (merged.buckets[b] == 0) continue;
+                double lower = std::ldexp(1.0, b % kHistogramLog2Buckets + kHistogramLog2Min);
+                if (b >= kHistogramLog2Buckets) lower = -lower;
+                entry += std::string(first ? "" : ", ") + "[" + format_double(lower) + ", " + format_double(merged.buckets[b]) + "]";
+                first = false;
+            }
+            entry += "]";
+        }
+        if (!merged.by_index.empty()) {
+            size_t used = merged.by_index.size();
+            while (used > 0 && merged.by_index[used - 1] == 0) --used;
+            entry += ", \"bins\": [";
+            for (size_t i = 0; i < used; ++i) entry += (i ? ", " : "") + format_double(merged.by_index[i]);
+            entry += "]";
+        }
+        write_trace_entry(entry + "}}");
+    }
+}
+
+// --- Clock Domains ---
+// A clock domain maps caller timestamps onto the tracer timebase (microseconds,
+// the same unit as the trace "ts" field and __itt_get_timestamp). The domain's
+// clock_base is anchored to the tracer time at which its callback was last
+// queried, i.e. at creation and on every __itt_clock_domain_reset.
+struct ClockAnchor {
+    long long anchor_us;
+};
+
+static std::mutex g_clock_domain_mutex;
+static __itt_clock_domain* g_clock_domains = nullptr;
+
+static void query_clock_domain(__itt_clock_domain* clock_domain) {
+    if (clock_domain->fn) clock_domain->fn(&clock_domain->info, clock_domain->fn_data);
+    static_cast<ClockAnchor*>(clock_domain->extra2)->anchor_us = get_time_us();
+}
+
+// Converts a caller-supplied timestamp to trace microseconds without reading
+// the clock, unless the caller passed __itt_timestamp_none.
+static long long resolve_timestamp(const __itt_clock_domain* clock_domain, unsigned long long timestamp) {
+    if (timestamp == __itt_timestamp_none) return get_time_us();
+    if (!clock_domain) return static_cast<long long>(timestamp);
+    const ClockAnchor* anchor = static_cast<const ClockAnchor*>(clock_domain->extra2);
+    __int128 delta = static_cast<__int128>(timestamp) - static_cast<__int128>(clock_domain->info.clock_base);
+    unsigned long long freq = clock_domain->info.clock_freq;
+    if (freq) delta = delta * 1000000 / freq;
+    return anchor->anchor_us + static_cast<long long>(delta);
+}
+
+// --- Nesting Validation ---
+// __itt_task_end only closes a frame begun in the same domain. An end whose
+// domain is not on top of the stack is a mismatched end: the frames above the
+// nearest frame of that domain are closed as truncated at the same time, so
+// the stack stays consistent and the durations below them stay right. An end
+// with no frame of its domain on the stack is an orphaned end and is ignored.
+// Both only happen on the error path, so the counters take a mutex.
+struct NestingErrors {
+    unsigned long long mismatched = 0;
+    unsigned long long orphaned = 0;
+    unsigned long long unwound = 0; // frames closed early by mismatched ends
+};
+
+static std::mutex g_nesting_mutex;
+static std::map<const __itt_domain*, NestingErrors>& nesting_errors() {
+    static auto* errors = new std::map<const __itt_domain*, NestingErrors>();
+    return *errors;
+}
+
+static void record_nesting_error(const __itt_domain* domain, size_t unwound) {
+    std::lock_guard<std::mutex> lock(g_nesting_mutex);
+    NestingErrors& errors = nesting_errors()[domain];
+    if (unwound) {
+        errors.mismatched++;
+        errors.unwound += unwound;
+    } else {
+        errors.orphaned++;
+    }
+}
+
+static void write_nesting_report() {
+    std::lock_guard<std::mutex> lock(g_nesting_mutex);
+    for (const auto& item : nesting_errors()) {
+        const NestingErrors& errors = item.second;
+        std::string entry = "{\"name\": \"colintrace_nesting\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+                            ", \"tid\": 0, \"args\": {\"domain\": \"" + item.first->nameA +
+                            "\", \"mismatched_ends\": " + std::to_string(errors.mismatched) +
+                            ", \"orphaned_ends\": " + std::to_string(errors.orphaned) +
+                            ", \"unwound_frames\": " + std::to_string(errors.unwound) + "}}";
+        write_trace_entry(entry);
+        fprintf(stderr, "[colintrace] Domain %s: %llu mismatched and %llu orphaned __itt_task_end calls\n", item.first->nameA,
+                errors.mismatched, errors.orphaned);
+    }
+}
+
+// --- Module Table ---
+// Records every mapped ELF object (path, load bias, address range and GNU
+// build-id) as "colintrace_module" metadata so offline tools can symbolize
+// recorded addresses without access to the process. The table is written once
+// at startup and then diffed against dl_iterate_phdr whenever the loader's
+// add/remove counters have moved.
+//
+// dlopen is deliberately not interposed: glibc resolves RUNPATH and $ORIGIN
+// from the caller's address, which a wrapper would replace with ours. New
+// objects are instead picked up on the next rescan, which happens on dlclose
+// (before the object goes away), on the ITT module calls and at finalization.
+struct ModuleInfo {
+    std::string path;
+    uintptr_t base = 0;
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    std::string build_id;
+    bool from_itt = false; // announced via __itt_module_load, not by the loader
+};
+
+struct ModuleTable {
+    std::mutex mutex;
+    std::map<std::pair<std::string, uintptr_t>, ModuleInfo> modules;
+    unsigned long long adds = 0;
+    unsigned long long subs = 0;
+    bool scanned = false;
+};
+
+// Function-local for the same reason as buffer_pool().
+static ModuleTable& module_table() {
+    static ModuleTable* table = new ModuleTable();
+    return *table;
+}
+
+static std::string read_build_id(const dl_phdr_info* info) {
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_NOTE) continue;
+        const unsigned char* note = reinterpret_cast<const unsigned char*>(info->dlpi_addr + phdr.p_vaddr);
+        const unsigned char* note_end = note + phdr.p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= note_end) {
+            const ElfW(Nhdr)* header = reinterpret_cast<const ElfW(Nhdr)*>(note);
+            const unsigned char* name = note + sizeof(ElfW(Nhdr));
+            const unsigned char* desc = name + ((header->n_namesz + 3) & ~3u);
+            if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 && memcmp(name, "GNU", 4) == 0 &&
+                desc + header->n_descsz <= note_end) {
+                std::string id;
+                char byte[3];
+                for (unsigned j = 0; j < header->n_descsz; ++j) {
+                    snprintf(byte, sizeof(byte), "%02x", desc[j]);
+                    id += byte;
+                }
+                return id;
+            }
+            note = desc + ((header->n_descsz + 3) & ~3u);
+        }
+    }
+    return "";
+}
+
+static std::string executable_path() {
+    char buf[4096];
+    ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    return len > 0 ? std::string(buf, len) : std::string();
+}
+
+static std::string module_entry(const ModuleInfo& module, const char* event) {
+    return "{\"name\": \"colintrace_module\", \"ph\": \"M\", \"pid\": " + std::to_string(getpid()) +
+                        ", \"tid\": 0, \"args\": {\"event\": \"" + event + "\", \"path\": \"" +
+                        json_escape(module.path.c_str(), module.path.size()) + "\", \"base\": \"" + hex_address(module.base) +
+                        "\", \"start\": \"" + hex_address(module.start) + "\", \"end\": \"" + hex_address(module.end) +
+                        "\", \"build_id\": \"" + module.build_id + "\"}}";
+}
+
+static void write_module_entry(const ModuleInfo& module, const char* event) {
+    write_trace_entry(module_entry(module, event));
+}
+
+static int collect_module(dl_phdr_info* info, size_t, void* data) {
+    auto* modules = static_cast<std::vector<ModuleInfo>*>(data);
+    ModuleInfo module;
+    module.path = (info->dlpi_name && *info->dlpi_name) ? info->dlpi_name : "";
+    if (module.path.empty() && modules->empty()) {
+        static const std::string exe = executable_path(); // the first entry is the main program
+        module.path = exe;
+    }
+    module.base = info->dlpi_addr;
+    module.start = UINTPTR_MAX;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD) continue;
+        module.start = std::min<uintptr_t>(module.start, info->dlpi_addr + phdr.p_vaddr);
+        module.end = std::max<uintptr_t>(module.end, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+    }
+    if (module.start == UINTPTR_MAX) module.start = module.base;
+    module.build_id = read_build_id(info);
+    modules->push_back(std::move(module));
+    return 0;
+}
+
+static int read_loader_counters(dl_phdr_info* info, size_t size, void* data) {
+    auto* counters = static_cast<std::pair<unsigned long long, unsigned long long>*>(data);
+    if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        counters->first = info->dlpi_adds;
+        counters->second = info->dlpi_subs;
+    }
+    return 1; // the counters are the same on every entry, stop after the first
+}
+
+// Writes load records for new objects and unload records for vanished ones.
+static void scan_modules() {
+    ModuleTable& table = module_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    std::pair<unsigned long long, unsigned long long> counters(0, 0);
+    dl_iterate_phdr(read_loader_counters, &counters);
+    if (table.scanned && counters.first == table.adds && counters.second == table.subs) return;
+    table.scanned = true;
+    table.adds = counters.first;
+    table.subs = counters.second;
+
+    std::vector<ModuleInfo> current;
+    dl_iterate_phdr(collect_module, &current);
+    std::map<std::pair<std::string, uintptr_t>, ModuleInfo> seen;
+    for (ModuleInfo& module : current) {
+        auto key = std::make_pair(module.path, module.base);
+        if (!table.modules.count(key)) write_module_entry(module, "load");
+        seen[key] = std::move(module);
+    }
+    for (const auto& item : table.modules) {
+        // Modules reported through __itt_module_load are not in the loader's list.
+        if (item.second.from_itt) seen[item.first] = item.second;
+        else if (!seen.count(item.first)) write_module_entry(item.second, "unload");
+    }
+    table.modules.swap(seen);
+}
+
+// --- Segment Rotation ---
+// With COLINTRACE_ROTATE_MB and/or COLINTRACE_ROTATE_SECONDS the trace is
+// written as numbered segments <base>.<n>.json, where <base> is the output
+// path without a trailing ".json". Each segment is a complete
+// trace that starts with the thread names and module table known so far.
+// COLINTRACE_KEEP_SEGMENTS=K deletes all but the last K segments. A writer
+// thread owns the file while rotating: producers hand it their full buffers
+// (swapping in an empty string from its spare list) and never wait on file
+// I/O or on a rotation.
+struct SegmentWriter {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::string> queue;
+    std::vector<std::string> spare;
+    bool stop = false;
+    std::thread thread;
+    std::string base; // output path without ".json"
+    long long max_bytes = 0;
+    long long max_us = 0;
+    long long keep = 0;
+    unsigned long long segment = 0;
+    long long segment_bytes = 0;
+    long long segment_start_us = 0;
+};
+
+static constexpr size_t kMaxSpareChunks = 64;
 
-static std::mutex g_string_handle_mutex;
-static std::map<std::string, __itt_string_handle*> g_string_handle_map;
+static SegmentWriter& segment_writer() {
+    static SegmentWriter* writer = new SegmentWriter();
+    return *writer;
+}
 
-// Global state for ITT events
-static std::mutex g_event_mutex;
-static std::vector<std::string> g_event_names;
+static std::string segment_path(const SegmentWriter& writer, unsigned long long segment) {
+    return writer.base + "." + std::to_string(segment) + ".json";
+}
 
-struct TaskInfo {
-    std::string name;
-    std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
+static void enqueue_chunk(std::string& chunk) {
+    SegmentWriter& writer = segment_writer();
+    std::string spare;
+    {
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.queue.push_back(std::move(chunk));
+        if (!writer.spare.empty()) {
+            spare = std::move(writer.spare.back());
+            writer.spare.pop_back();
+        }
+    }
+    writer.wake.notify_one();
+    chunk = std::move(spare);
+    chunk.clear();
+}
+
+// Opens segment writer.segment and writes its header and name table.
+static void open_segment(SegmentWriter& writer) {
+    {
+        std::lock_guard<std::mutex> lock(g_file_mutex);
+        g_trace_file = fopen(segment_path(writer, writer.segment).c_str(), "w");
+        if (g_trace_file) fputs("{\"traceEvents\": [\n", g_trace_file);
+        g_is_first_event.store(true);
+    }
+    writer.segment_bytes = 0;
+    writer.segment_start_us = get_time_us();
+    std::string names;
+    {
+        ThreadNames& threads = thread_names();
+        std::lock_guard<std::mutex> lock(threads.mutex);
+        for (const auto& item : threads.names) names += ",\n" + thread_name_entry(item.first, item.second);
+    }
+    {
+        ModuleTable& table = module_table();
+        std::lock_guard<std::mutex> lock(table.mutex);
+        for (const auto& item : table.modules) names += ",\n" + module_entry(item.second, "load");
+    }
+    if (!names.empty()) write_file_chunk(names.data(), names.size());
+}
+
+static void rotate_segment(SegmentWriter& writer) {
+    {
+        std::lock_guard<std::mutex> lock(g_file_mutex);
+        if (!g_trace_file) return;
+        fputs("\n]}\n", g_trace_file);
+        fclose(g_trace_file);
+        g_trace_file = nullptr;
+    }
+    writer.segment++;
+    if (writer.keep > 0 && writer.segment >= static_cast<unsigned long long>(writer.keep)) {
+        unlink(segment_path(writer, writer.segment - writer.keep).c_str());
+    }
+    open_segment(writer);
+}
+
+static void segment_writer_loop() {
+    prctl(PR_SET_NAME, "colintrace-wr", 0, 0, 0);
+    SegmentWriter& writer = segment_writer();
+    std::vector<std::string> batch;
+    for (;;) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(writer.mutex);
+            writer.wake.wait_for(lock, std::chrono::seconds(1), [&] { return writer.stop || !writer.queue.empty(); });
+            batch.swap(writer.queue);
+            stopping = writer.stop;
+        }
+        for (std::string& chunk : batch) {
+            write_file_chunk(chunk.data(), chunk.size());
+            writer.segment_bytes += chunk.size();
+            if (writer.max_bytes && writer.segment_bytes >= writer.max_bytes) rotate_segment(writer);
+        }
+        if (writer.max_us && writer.segment_bytes && get_time_us() - writer.segment_start_us >= writer.max_us) {
+            rotate_segment(writer);
+        }
+        {
+            std::lock_guard<std::mutex> lock(writer.mutex);
+            for (std::string& chunk : batch) {
+                if (writer.spare.size() >= kMaxSpareChunks) break;
+                chunk.clear();
+                writer.spare.push_back(std::move(chunk));
+            }
+        }
+        batch.clear();
+        if (stopping) {
+            std::lock_guard<std::mutex> lock(writer.mutex);
+            if (writer.queue.empty()) return;
+        }
+    }
+}
+
+// Opens the first segment and starts the writer if rotation is configured.
+// Returns the first segment's path, or an empty string when not rotating.
+static std::string start_segment_writer(const std::string& path) {
+    SegmentWriter& writer = segment_writer();
+    writer.max_bytes = std::max(0LL, env_ll("COLINTRACE_ROTATE_MB", 0)) * 1024 * 1024;
+    writer.max_us = std::max(0LL, env_ll("COLINTRACE_ROTATE_SECONDS", 0)) * 1000000;
+    writer.keep = std::max(0LL, env_ll("COLINTRACE_KEEP_SEGMENTS", 0));
+    if (!writer.max_bytes && !writer.max_us) return "";
+    writer.base = path;
+    if (path.size() > 5 && path.compare(path.size() - 5, 5, ".json") == 0) writer.base.resize(path.size() - 5);
+    open_segment(writer);
+    writer.thread = std::thread(segment_writer_loop);
+    g_rotating.store(true, std::memory_order_release);
+    return segment_path(writer, 0);
+}
+
+// Hands the file back to the caller once every queued chunk is written.
+static void stop_segment_writer() {
+    if (!g_rotating.exchange(false)) return;
+    SegmentWriter& writer = segment_writer();
+    {
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.stop = true;
+    }
+    writer.wake.notify_one();
+    if (writer.thread.joinable()) writer.thread.join();
+}
+
+// --- Control Channel ---
+// With COLINTRACE_CONTROL=1 the tracer creates a FIFO at
+// /tmp/colintrace.<pid>.ctl and serves it from its own thread. Each line is a
+// command:
+//   domain <glob> on|off   enable or disable matching domains
+//   pause | resume         same as __itt_pause / __itt_resume
+//   sample <N>             write only every Nth task per thread (1 = all)
+//   flush                  drain the thread buffers into the trace file
+//   dump                   print collection state and domains to stderr
+// Commands only store to atomics (and to the domains' flags words), so the
+// instrumented threads never wait on the control thread.
+// A plain array so that finalize_trace can still read it after static
+// destructors have run.
+static char g_control_path[64];
+
+static void control_dump() {
+    static const char* const states[] = {"collecting", "paused", "detached"};
+    fprintf(stderr, "[colintrace] control: %s, sample period %u\n", states[g_collection_state.load()], g_sample_period.load());
+    std::lock_guard<std::mutex> lock(g_domain_mutex);
+    for (const auto& item : domain_map()) {
+        fprintf(stderr, "[colintrace] control:   domain %s %s\n", item.first.c_str(), item.second->flags & 1 ? "on" : "off");
+    }
+}
+
+static void control_command(const std::string& line) {
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        size_t start = line.find_first_not_of(" \t\r", pos);
+        if (start == std::string::npos) break;
+        size_t end = line.find_first_of(" \t\r", start);
+        if (end == std::string::npos) end = line.size();
+        words.push_back(line.substr(start, end - start));
+        pos = end;
+    }
+    if (words.empty()) return;
+    const std::string& command = words[0];
+    if (command == "pause" && words.size() == 1) {
+        __itt_pause();
+    } else if (command == "resume" && words.size() == 1) {
+        __itt_resume();
+    } else if (command == "sample" && words.size() == 2 && atoi(words[1].c_str()) > 0) {
+        g_sample_period.store(static_cast<unsigned>(atoi(words[1].c_str())), std::memory_order_relaxed);
+    } else if (command == "flush" && words.size() == 1) {
+        flush_all_buffers();
+        std::lock_guard<std::mutex> lock(g_file_mutex);
+        if (g_trace_file) fflush(g_trace_file);
+    } else if (command == "dump" && words.size() == 1) {
+        control_dump();
+        return;
+    } else if (command == "domain" && words.size() == 3 && (words[2] == "on" || words[2] == "off")) {
+        int flags = words[2] == "on" ? 1 : kDomainSwitchedOff;
+        std::lock_guard<std::mutex> lock(g_domain_mutex);
+        for (const auto& item : domain_map()) {
+            if (fnmatch(words[1].c_str(), item.first.c_str(), 0) == 0) {
+                __atomic_store_n(&item.second->flags, flags, __ATOMIC_RELAXED);
+            }
+        }
+    } else {
+        fprintf(stderr, "[colintrace] control: unknown command: %s\n", line.c_str());
+        return;
+    }
+    fprintf(stderr, "[colintrace] control: %s\n", line.c_str());
+}
+
+static void control_loop(int fd) {
+    prctl(PR_SET_NAME, "colintrace-ctl", 0, 0, 0);
+    std::string pending;
+    char buf[512];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pending.append(buf, n);
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            control_command(pending.substr(0, newline));
+            pending.erase(0, newline + 1);
+        }
+    }
+    close(fd);
+}
+
+static void start_control_channel() {
+    if (env_ll("COLINTRACE_CONTROL", 0) == 0) return;
+    std::string path = "/tmp/colintrace." + std::to_string(getpid()) + ".ctl";
+    unlink(path.c_str());
+    if (mkfifo(path.c_str(), 0600) != 0) {
+        fprintf(stderr, "[colintrace] Cannot create control FIFO %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    // Opened read-write so the read end never sees EOF between writers.
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        unlink(path.c_str());
+        return;
+    }
+    snprintf(g_control_path, sizeof(g_control_path), "%s", path.c_str());
+    std::thread(control_loop, fd).detach();
+    fprintf(stderr, "[colintrace] Control channel at %s\n", path.c_str());
+}
+
+// --- Output Naming ---
+// The trace goes to COLINTRACE_OUTPUT_DIR (default: the working directory)
+// under the COLINTRACE_OUTPUT_NAME template (default "trace.pid_%p.json"):
+//   %p pid   %h host name   %t start time (YYYYmmdd-HHMMSS)
+//   %r rank from the launcher (OMPI_COMM_WORLD_RANK, PMI_RANK, PMIX_RANK or
+//      SLURM_PROCID; "0" when none is set)   %% a literal %
+// The expanded name is used as is; only rotated segments change it (see
+// Segment Rotation).
+static std::string launcher_rank() {
+    for (const char* name : {"OMPI_COMM_WORLD_RANK", "PMI_RANK", "PMIX_RANK", "SLURM_PROCID"}) {
+        const char* value = getenv(name);
+        if (value && *value) return value;
+    }
+    return "0";
+}
+
+static std::string expand_output_name(const char* name_template) {
+    std::string out;
+    for (const char* p = name_template; *p; ++p) {
+        if (*p != '%' || !p[1]) {
+            out += *p;
+            continue;
+        }
+        switch (*++p) {
+            case 'p':
+                out += std::to_string(getpid());
+                break;
+            case 'h': {
+                char host[256] = {};
+                gethostname(host, sizeof(host) - 1);
+                out += host;
+                break;
+            }
+            case 't': {
+                char stamp[32];
+                time_t now = time(nullptr);
+                tm local;
+                localtime_r(&now, &local);
+                strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+                out += stamp;
+                break;
+            }
+            case 'r':
+                out += launcher_rank();
+                break;
+            default:
+                out += *p; // "%%" and unknown conversions
+                break;
+        }
+    }
+    return out;
+}
+
+// Creates dir and its missing parents; failures surface when the trace is opened.
+static void make_directories(const std::string& dir) {
+    for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+        mkdir(dir.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos) break;
+    }
+}
+
+static std::string trace_output_path() {
+    const char* name_template = getenv("COLINTRACE_OUTPUT_NAME");
+    std::string name = expand_output_name(name_template && *name_template ? name_template : "trace.pid_%p.json");
+    const char* dir = getenv("COLINTRACE_OUTPUT_DIR");
+    if (!dir || !*dir) return name;
+    make_directories(dir);
+    std::string path = dir;
+    if (path.back() != '/') path += '/';
+    return path + name;
+}
+
+// --- Collector Mode ---
+// Applications that go through the static ittnotify library instead of
+// calling the functions directly load us from INTEL_LIBITTNOTIFY64 on their
+// first ITT call, and ittnotify then hands __itt_api_init its table of
+// function pointers. Only the head of __itt_global is mirrored here, up to
+// string_list; it comes from ittnotify_config.h, which include/ does not
+// ship, and has kept this layout since the 2010 API.
+struct IttApiInfo {
+    const char* name;
+    void** func_ptr;
+    void* init_func;
+    void* null_func;
+    int group; // __itt_group_id
 };
 
-// Per-thread storage for ongoing events and tasks
-static thread_local std::stack<TaskInfo> g_task_stack;
-static thread_local std::map<__itt_event, std::chrono::time_point<std::chrono::high_resolution_clock>> g_event_start_times;
+struct IttGlobalHead {
+    unsigned char magic[8];
+    unsigned long version_major;
+    unsigned long version_minor;
+    unsigned long version_build;
+    volatile long api_initialized;
+    volatile long mutex_initialized;
+    volatile long atomic_counter;
+    pthread_mutex_t mutex;
+    void* lib;
+    void* error_handler;
+    const char** dll_path_ptr;
+    IttApiInfo* api_list_ptr;
+    void* next;
+    void* thread_list;
+    __itt_domain* domain_list;
+    __itt_string_handle* string_list;
+};
 
+static const unsigned char kIttGlobalMagic[8] = {0xED, 0xAB, 0xAB, 0xEC, 0x0D, 0xEE, 0xDA, 0x30};
 
-// --- Utility Functions ---
-static long long get_time_us() {
-    return std::chrono::duration_cast<std::chrono::microseconds>(
-        std::chrono::high_resolution_clock::now().time_since_epoch()
-    ).count();
+// Our own handle, so that table entries resolve against this library only
+// and never against ittnotify's symbols in the executable.
+static void* self_handle() {
+    Dl_info info;
+    if (!dladdr(reinterpret_cast<void*>(&self_handle), &info) || !info.dli_fname) return nullptr;
+    return dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
 }
 
-static void write_trace_entry(const std::string& entry) {
-    std::lock_guard<std::mutex> lock(g_file_mutex);
-    if (g_trace_file_ptr && g_trace_file_ptr->is_open()) {
-        if (!g_is_first_event.exchange(false)) {
-            (*g_trace_file_ptr) << ",\n";
+// Points every entry we implement straight at the override and the rest at
+// ittnotify's null stubs. Returns the number of entries wired to us.
+static int fill_api_table(IttGlobalHead* global, int groups) {
+    void* self = self_handle();
+    int wired = 0;
+    for (IttApiInfo* api = global->api_list_ptr; api && api->name; ++api) {
+        void* fn = (self && (api->group & groups)) ? dlsym(self, api->name) : nullptr;
+        *api->func_ptr = fn ? fn : api->null_func;
+        if (fn) ++wired;
+    }
+    return wired;
+}
+
+// ittnotify creates domains and string handles itself until its first other
+// call loads us, and the application keeps using those. They get the same
+// filter decisions as ours and are registered so later creates return them.
+static void adopt_itt_handles(IttGlobalHead* global) {
+    {
+        std::lock_guard<std::mutex> lock(g_domain_mutex);
+        for (__itt_domain* d = global->domain_list; d; d = d->next) {
+            if (!d->nameA || domain_map().count(d->nameA)) continue;
+            d->flags = domain_enabled(d->nameA) ? 1 : 0;
+            d->extra1 = min_duration_for(d->nameA);
+            domain_map()[d->nameA] = d;
         }
-        (*g_trace_file_ptr) << entry;
     }
+    std::lock_guard<std::mutex> lock(g_string_handle_mutex);
+    for (__itt_string_handle* h = global->string_list; h; h = h->next) {
+        if (!h->strA || string_handle_map().count(h->strA)) continue;
+        h->extra1 = name_filtered(h->strA) ? kNameFiltered : 0;
+        string_handle_map()[h->strA] = h;
+    }
+}
+
+// --- Initialization / Destructor ---
+// Called once by ensure_initialized().
+static void tracer_init() {
+    std::string path = trace_output_path();
+    std::string filename = start_segment_writer(path);
+    if (filename.empty()) {
+        filename = path;
+        g_trace_file = fopen(filename.c_str(), "w");
+        if (g_trace_file) fputs("{\"traceEvents\": [\n", g_trace_file);
+    }
+    if (!g_trace_file) fprintf(stderr, "[colintrace] Cannot open %s: %s\n", filename.c_str(), strerror(errno));
+    fprintf(stderr, "[colintrace] Tracer loaded. Logging to %s\n", filename.c_str());
+    scan_modules();
+    if (g_thread_buffer) {
+        // Put the module table at the start of the trace (or first segment).
+        std::lock_guard<std::mutex> lock(g_thread_buffer->mutex);
+        flush_buffer(*g_thread_buffer);
+    }
+    start_control_channel();
+    start_governor();
 }
 
-// --- Constructor / Destructor ---
-__attribute__((constructor))
-void tracer_init() {
-    g_trace_file_ptr = new std::ofstream();
-    std::string filename = "trace.pid_" + std::to_string(getpid()) + ".json";
-    g_trace_file_ptr->open(filename);
-    (*g_trace_file_ptr) << "{\"traceEvents\": [\n";
-    std::cerr << "[colintrace] Tracer loaded. Logging to " << filename << std::endl;
+// Writes the exit summaries and closes the trace. Runs once, from whichever of
+// __itt_detach or the library destructor comes first, and does nothing in a
+// process that never made an ITT call.
+static void finalize_trace() {
+    static std::atomic<bool> finalized{false};
+    if (!initialized() || finalized.exchange(true)) return;
+    scan_modules();
+    write_throughput_summary();
+    write_contention_report();
+    write_histogram_summary();
+    write_nesting_report();
+    write_dropped_summary();
+    // Flows still waiting on an instance can no longer be completed.
+    task_instances().clear();
+    flush_all_buffers();
+    stop_segment_writer();
+    if (g_control_path[0]) unlink(g_control_path);
+    std::lock_guard<std::mutex> lock(g_file_mutex);
+    if (g_trace_file) {
+        fputs("\n]}\n", g_trace_file);
+        fclose(g_trace_file);
+        g_trace_file = nullptr;
+        fprintf(stderr, "[colintrace] Tracer finalized.\n");
+    }
 }
 
 __attribute__((destructor))
 void tracer_cleanup() {
-    if (g_trace_file_ptr && g_trace_file_ptr->is_open()) {
-        (*g_trace_file_ptr) << "\n]}\n";
-        g_trace_file_ptr->close();
-        delete g_trace_file_ptr;
-        g_trace_file_ptr = nullptr;
-        std::cerr << "[colintrace] Tracer finalized." << std::endl;
-    }
+    finalize_trace();
 }
 
 // --- Overridden ITT API Functions ---
@@ -92,27 +2727,30 @@ extern "C" {
 // --- Domain and String Handle Management (unitrace style) ---
 __itt_domain* __itt_domain_create(const char* name) {
     if (!name) return nullptr;
+    ensure_initialized();
     std::lock_guard<std::mutex> lock(g_domain_mutex);
-    auto it = g_domain_map.find(name);
-    if (it != g_domain_map.end()) {
+    auto it = domain_map().find(name);
+    if (it != domain_map().end()) {
         return it->second; // Return existing domain
     }
     // Create new domain if it doesn't exist
     __itt_domain* d = new __itt_domain();
-    d->flags = 1; // Mark as enabled
+    d->flags = domain_enabled(name) ? 1 : 0;
+    d->extra1 = min_duration_for(name);
     char* name_copy = new char[strlen(name) + 1];
     strcpy(name_copy, name);
     d->nameA = name_copy;
     d->nameW = nullptr;
-    g_domain_map[name] = d;
+    domain_map()[name] = d;
     return d;
 }
 
 __itt_string_handle* __itt_string_handle_create(const char* name) {
     if (!name) return nullptr;
+    ensure_initialized();
     std::lock_guard<std::mutex> lock(g_string_handle_mutex);
-    auto it = g_string_handle_map.find(name);
-    if (it != g_string_handle_map.end()) {
+    auto it = string_handle_map().find(name);
+    if (it != string_handle_map().end()) {
         return it->second; // Return existing handle
     }
     // Create new handle if it doesn't exist
@@ -121,75 +2759,774 @@ __itt_string_handle* __itt_string_handle_create(const char* name) {
     strcpy(name_copy, name);
     h->strA = name_copy;
     h->strW = nullptr;
-    g_string_handle_map[name] = h;
+    h->extra1 = name_filtered(name) ? kNameFiltered : 0;
+    string_handle_map()[name] = h;
     return h;
 }
 
-// --- Task Tracing ---
-void __itt_task_begin(const __itt_domain* domain, __itt_id, __itt_id, __itt_string_handle* name) {
-    if (!domain || !(domain->flags & 1) || !name || !name->strA) return;
-    g_task_stack.push({std::string(domain->nameA) + "::" + std::string(name->strA),
-                       std::chrono::high_resolution_clock::now()});
+// --- Thread Naming ---
+// A name set before the thread's first event is written by current_thread();
+// a later rename writes a new thread_name record, which viewers apply to the
+// whole thread.
+void __itt_thread_set_name(const char* name) {
+    if (detached() || !name) return;
+    bool known = g_thread.tid != 0;
+    g_thread.name = json_escape(name, strlen(name));
+    if (!collecting()) {
+        g_thread.tid = 0; // written by current_thread() on the first event after resume
+    } else if (known) {
+        write_thread_name(g_thread);
+    } else {
+        current_thread();
+    }
 }
 
-void __itt_task_end(const __itt_domain* domain) {
-    if (!domain || !(domain->flags & 1) || g_task_stack.empty()) return;
+// --- Collection Control ---
+// Pause boundaries: a task begun while collecting and ended while paused is
+// written clipped to the pause time with a "truncated" arg; a task begun while
+// paused is never written, even if it ends after __itt_resume. Tasks that stay
+// open across a whole pause/resume cycle are written with their real duration.
+// The clip point only moves on the collecting -> paused transition; a
+// redundant pause leaves it alone. It is stored before the state flips so
+// that any thread seeing kPaused also sees the time.
+void __itt_pause(void) {
+    if (g_collection_state.load() != kCollecting) return;
+    g_pause_us.store(get_time_us(), std::memory_order_relaxed);
+    int expected = kCollecting;
+    g_collection_state.compare_exchange_strong(expected, kPaused);
+}
 
-    TaskInfo task = g_task_stack.top();
-    g_task_stack.pop();
+void __itt_resume(void) {
+    int expected = kPaused;
+    g_collection_state.compare_exchange_strong(expected, kCollecting);
+}
 
-    long long start_us = std::chrono::duration_cast<std::chrono::microseconds>(task.start_time.time_since_epoch()).count();
-    long long end_us = get_time_us();
+void __itt_pause_scoped(__itt_collection_scope scope) {
+    if (scope & __itt_collection_scope_host) __itt_pause();
+}
+
+void __itt_resume_scoped(__itt_collection_scope scope) {
+    if (scope & __itt_collection_scope_host) __itt_resume();
+}
+
+// Stops collection for good: the trace is finalized and the shared tables are
+// released. Domains and string handles stay valid because the application
+// still holds pointers to them.
+void __itt_detach(void) {
+    if (g_collection_state.exchange(kDetached) == kDetached) return;
+    finalize_trace();
+    release_buffer_pool();
+    overlapped_tasks().clear();
+    heap_allocations().clear();
+    sync_objects().clear();
+    {
+        std::lock_guard<std::mutex> lock(g_throughput_mutex);
+        throughput_totals().clear();
+        for (ThroughputAccum* accum : throughput_accums()) {
+            std::lock_guard<std::mutex> accum_lock(accum->mutex);
+            accum->stats.clear();
+        }
+    }
+}
+
+// --- Task Tracing ---
+// Shared by the plain and *_ex entry points; the clock is only read when the
+// caller did not supply a timestamp.
+static void begin_task(const __itt_domain* domain, __itt_id taskid, __itt_string_handle* name, void* fn,
+                       const __itt_clock_domain* clock_domain, unsigned long long timestamp) {
+    bool skip = !collecting();
+    OverheadScope overhead(!skip);
+    if (skip) {
+        if (detached() || !domain || !domain->flags) return;
+    } else {
+        if (!domain || !domain->flags) return;
+        // A begin without a usable name, or on a domain switched off at
+        // runtime, still gets a placeholder so that the matching end pops it
+        // rather than an enclosing task.
+        unsigned period = g_sample_period.load(std::memory_order_relaxed);
+        skip = !(domain->flags & 1) || (!fn && (!name || !name->strA || (name->extra1 & kNameFiltered))) ||
+               (period > 1 && ++g_sample_tick % period != 0) || (g_governed && !fn && governor_skips(name));
+    }
+    TaskStack& stack = task_stack();
+    arm_thread_exit_hook();
+    if (skip) {
+        stack.emplace_back(domain);
+        return;
+    }
+    long long start_us = resolve_timestamp(clock_domain, timestamp);
+    stack.emplace_back(domain, fn ? nullptr : name, fn, start_us, taskid);
+    if (!is_null_id(taskid)) {
+        instance_begin(taskid, start_us, event_tid(), false);
+    }
+}
+
+// Writes a popped frame ending at end_us. truncated names the reason the
+// frame was cut short, or is null.
+static void write_task(TaskInfo& task, long long end_us, const char* truncated) {
+    long long start_us = task.start_us;
     long long duration_us = end_us - start_us;
 
-    std::string entry = "{\"name\": \"" + task.name + "\", \"cat\": \"task\", \"ph\": \"X\", \"ts\": " + std::to_string(start_us) +
+    std::string entry = "{\"name\": \"" + task_name(task.domain, task.name, task.fn) + "\", \"cat\": \"task\", \"ph\": \"X\", \"ts\": " + std::to_string(start_us) +
              ", \"dur\": " + std::to_string(duration_us) + ", \"pid\": " + std::to_string(getpid()) +
-             ", \"tid\": " + std::to_string(syscall(SYS_gettid)) + "}";
+             ", \"tid\": " + std::to_string(event_tid());
+    bool has_heap = task.heap.allocs || task.heap.frees;
+    if (task.args.used || task.args.overflow || has_heap || truncated || task.fn) {
+        std::string args = format_task_args(task.args);
+        if (task.fn) args += std::string(args.empty() ? "" : ", ") + "\"fn\": \"" + hex_address(reinterpret_cast<uintptr_t>(task.fn)) + "\"";
+        if (has_heap) append_heap_args(args, task.heap);
+        if (truncated) args += std::string(args.empty() ? "" : ", ") + "\"truncated\": \"" + truncated + "\"";
+        entry += ", \"args\": {" + args + "}";
+        if (task.args.used) record_throughput(task, duration_us);
+    }
+    entry += "}";
 
     write_trace_entry(entry);
+
+    if (!is_null_id(task.id)) {
+        instance_end(task.id, start_us, end_us, event_tid());
+    }
+}
+
+static void end_task(const __itt_domain* domain, const __itt_clock_domain* clock_domain, unsigned long long timestamp) {
+    if (detached() || !domain) return;
+    OverheadScope overhead(collecting());
+    TaskStack& stack = task_stack();
+    // Domains filtered out at creation never have frames. One switched off at
+    // runtime keeps pushing placeholders, so its ends are matched as usual.
+    if (!domain->flags) return;
+    size_t match = stack.size();
+    while (match > 0 && stack[match - 1].domain != domain) --match;
+    if (match == 0) {
+        record_nesting_error(domain, 0);
+        return;
+    }
+    size_t unwound = stack.size() - match;
+    if (unwound) record_nesting_error(domain, unwound);
+
+    bool paused = !collecting();
+    long long end_us = 0;
+    bool have_end = false;
+    while (stack.size() >= match) {
+        TaskInfo task = std::move(stack.back());
+        stack.pop_back();
+        if (task.placeholder) continue;
+        if (!have_end) {
+            end_us = paused ? g_pause_us.load(std::memory_order_relaxed) : resolve_timestamp(clock_domain, timestamp);
+            have_end = true;
+        }
+        const char* truncated = paused ? "pause" : (stack.size() >= match ? "unbalanced" : nullptr);
+        long long duration_us = end_us - task.start_us;
+        if (!truncated && task.domain->extra1 > duration_us && is_null_id(task.id)) {
+            record_dropped(task, std::max(0LL, duration_us));
+            continue;
+        }
+        write_task(task, std::max(task.start_us, end_us), truncated);
+    }
+}
+
+void __itt_task_begin(const __itt_domain* domain, __itt_id taskid, __itt_id, __itt_string_handle* name) {
+    begin_task(domain, taskid, name, nullptr, nullptr, __itt_timestamp_none);
+}
+
+void __itt_task_begin_fn(const __itt_domain* domain, __itt_id taskid, __itt_id, void* fn) {
+    begin_task(domain, taskid, nullptr, fn, nullptr, __itt_timestamp_none);
+}
+
+void __itt_task_end(const __itt_domain* domain) {
+    end_task(domain, nullptr, __itt_timestamp_none);
+}
+
+// --- Overlapped Task Tracing ---
+static void begin_overlapped(const __itt_domain* domain, __itt_id taskid, __itt_string_handle* name,
+                             const __itt_clock_domain* clock_domain, unsigned long long timestamp) {
+    if (!collecting() || !domain || !(domain->flags & 1) || !name || !name->strA || (name->extra1 & kNameFiltered) ||
+        is_null_id(taskid)) return;
+    long long start_us = resolve_timestamp(clock_domain, timestamp);
+    long tid = event_tid();
+    overlapped_tasks().insert(taskid, {task_name(domain, name), start_us, tid});
+    instance_begin(taskid, start_us, tid, false);
+}
+
+static void end_overlapped(const __itt_domain* domain, __itt_id taskid,
+                           const __itt_clock_domain* clock_domain, unsigned long long timestamp) {
+    if (!collecting()) {
+        // Drop the start record so a paused window does not leak table entries.
+        if (!detached()) overlapped_tasks().erase(taskid);
+        return;
+    }
+    if (!domain || !(domain->flags & 1)) return;
+
+    OverlappedTask task;
+    if (!overlapped_tasks().take(taskid, task)) return;
+
+    long long end_us = resolve_timestamp(clock_domain, timestamp);
+    std::string id = id_to_string(taskid);
+    long tid = event_tid();
+    write_trace_entry(make_async_entry(task.name, "b", task.start_us, task.tid, id));
+    write_trace_entry(make_async_entry(task.name, "e", end_us, tid, id));
+    instance_end(taskid, task.start_us, end_us, tid);
+}
+
+void __itt_task_begin_overlapped(const __itt_domain* domain, __itt_id taskid, __itt_id, __itt_string_handle* name) {
+    begin_overlapped(domain, taskid, name, nullptr, __itt_timestamp_none);
+}
+
+void __itt_task_end_overlapped(const __itt_domain* domain, __itt_id taskid) {
+    end_overlapped(domain, taskid, nullptr, __itt_timestamp_none);
+}
+
+// --- Ids and Relations ---
+void __itt_id_create(const __itt_domain* domain, __itt_id id) {
+    if (!collecting() || !domain || !(domain->flags & 1) || is_null_id(id)) return;
+    // Ids may be reused after __itt_id_destroy, so start from a clean instance.
+    TaskInstance inst;
+    inst.registered = true;
+    task_instances().insert(id, std::move(inst));
+    g_instances_used.store(true, std::memory_order_relaxed);
+}
+
+void __itt_id_destroy(const __itt_domain* domain, __itt_id id) {
+    if (detached() || !domain || !(domain->flags & 1) || is_null_id(id)) return;
+    task_instances().erase(id);
+}
+
+// A relation may name a task that is already running on the calling thread
+// and so began before it had an instance entry; record that begin now.
+static void register_open_task(const __itt_id& id) {
+    const TaskStack& stack = task_stack();
+    for (size_t i = stack.size(); i-- > 0;) {
+        if (!stack[i].placeholder && IdEqual()(stack[i].id, id)) {
+            instance_begin(id, stack[i].start_us, event_tid(), true);
+            return;
+        }
+    }
+}
+
+void __itt_relation_add(const __itt_domain* domain, __itt_id head, __itt_relation relation, __itt_id tail) {
+    if (!collecting() || !domain || !(domain->flags & 1)) return;
+    if (is_null_id(head) || is_null_id(tail)) return;
+    register_open_task(head);
+    register_open_task(tail);
+    add_relation(head, relation, tail);
+}
+
+void __itt_relation_add_to_current(const __itt_domain* domain, __itt_relation relation, __itt_id tail) {
+    if (!collecting() || !domain || !(domain->flags & 1)) return;
+    TaskStack& stack = task_stack();
+    if (stack.empty()) return;
+    TaskInfo& current = stack.back();
+    if (current.placeholder) return;
+    if (is_null_id(current.id)) {
+        // The current task was begun without an id; give it a private one so
+        // the relation has an instance to attach to.
+        current.id = __itt_id_make(nullptr, g_next_synthetic_id.fetch_add(1, std::memory_order_relaxed));
+        current.id.d3 = kSyntheticIdTag;
+    }
+    instance_begin(current.id, current.start_us, event_tid(), true);
+    add_relation(current.id, relation, tail);
 }
 
 // --- Event Tracing ---
 __itt_event __itt_event_create(const char* name, int namelen) {
+    if (!name || namelen < 0) return -1;
+    ensure_initialized();
     std::lock_guard<std::mutex> lock(g_event_mutex);
-    g_event_names.emplace_back(name, namelen);
-    return g_event_names.size() - 1;
+    size_t index = g_event_count.load(std::memory_order_relaxed);
+    if (index >= kEventChunk * kEventChunks) return -1;
+    EventInfo* chunk = g_event_chunks[index / kEventChunk].load(std::memory_order_relaxed);
+    if (!chunk) {
+        chunk = new EventInfo[kEventChunk];
+        g_event_chunks[index / kEventChunk].store(chunk, std::memory_order_relaxed);
+    }
+    std::string raw(name, namelen);
+    chunk[index % kEventChunk].name = json_escape(raw.c_str(), raw.size());
+    chunk[index % kEventChunk].filtered = name_filtered(raw);
+    g_event_count.store(index + 1, std::memory_order_release);
+    return static_cast<__itt_event>(index);
 }
 
 int __itt_event_start(__itt_event event) {
-    if (event >= g_event_names.size()) return -1;
+    if (!collecting()) return 0;
+    const EventInfo* info = find_event(event);
+    if (!info) return -1;
+    if (info->filtered) return 0;
+    arm_thread_exit_hook();
     g_event_start_times[event] = std::chrono::high_resolution_clock::now();
     return 0;
 }
 
 int __itt_event_end(__itt_event event) {
-    if (event >= g_event_names.size() || g_event_start_times.find(event) == g_event_start_times.end()) return -1;
+    if (!collecting()) {
+        if (!detached()) g_event_start_times.erase(event);
+        return 0;
+    }
+    const EventInfo* info = find_event(event);
+    if (!info) return -1;
+    if (info->filtered) return 0;
+    if (g_event_start_times.find(event) == g_event_start_times.end()) return -1;
     auto start_time = g_event_start_times[event];
     g_event_start_times.erase(event);
     long long start_us = std::chrono::duration_cast<std::chrono::microseconds>(start_time.time_since_epoch()).count();
     long long end_us = get_time_us();
-    std::string entry = "{\"name\": \"" + g_event_names[event] + "\", \"cat\": \"event\", \"ph\": \"X\", \"ts\": " + std::to_string(start_us) +
+    std::string entry = "{\"name\": \"" + info->name + "\", \"cat\": \"event\", \"ph\": \"X\", \"ts\": " + std::to_string(start_us) +
                         ", \"dur\": " + std::to_string(end_us - start_us) + ", \"pid\": " + std::to_string(getpid()) +
-                        ", \"tid\": " + std::to_string(syscall(SYS_gettid)) + "}";
+                        ", \"tid\": " + std::to_string(current_tid()) + "}";
     write_trace_entry(entry);
     return 0;
 }
 
+// --- Thread Exit ---
+// Runs when a thread that wrote trace entries exits: tasks and events it
+// still has open are written as truncated at the exit time, pending heap
+// deltas are folded in and its output buffer is flushed and recycled.
+ThreadExitHook::~ThreadExitHook() {
+    if (!armed) return;
+    if (!detached() && (!g_task_stack.empty() || !g_event_start_times.empty())) {
+        g_current_track = nullptr; // a track left set stays with the track, not the thread
+        bool paused = !collecting();
+        long long end_us = paused ? g_pause_us.load(std::memory_order_relaxed) : get_time_us();
+        const char* reason = paused ? "pause" : "thread_exit";
+        while (!g_task_stack.empty()) {
+            TaskInfo task = std::move(g_task_stack.back());
+            g_task_stack.pop_back();
+            if (!task.placeholder) write_task(task, std::max(task.start_us, end_us), reason);
+        }
+        for (const auto& item : g_event_start_times) {
+            const EventInfo* info = find_event(item.first);
+            if (!info) continue;
+            long long start_us = std::chrono::duration_cast<std::chrono::microseconds>(item.second.time_since_epoch()).count();
+            std::string entry = "{\"name\": \"" + info->name + "\", \"cat\": \"event\", \"ph\": \"X\", \"ts\": " +
+                                std::to_string(start_us) + ", \"dur\": " + std::to_string(std::max(0LL, end_us - start_us)) +
+                                ", \"pid\": " + std::to_string(getpid()) + ", \"tid\": " + std::to_string(current_tid()) +
+                                ", \"args\": {\"truncated\": \"" + reason + "\"}}";
+            write_trace_entry(entry);
+        }
+        g_event_start_times.clear();
+    }
+    retire_thread_throughput();
+    retire_thread_dropped();
+    flush_governor_slots();
+    if (g_thread.tid) forget_thread_name(g_thread.tid);
+    if (!detached() && g_heap_delta_count) flush_heap_deltas();
+    if (g_thread_buffer) release_thread_buffer(g_thread_buffer);
+    g_thread_buffer = nullptr;
+    g_thread_unbuffered = true;
+}
+
 // --- Marker Tracing ---
-void __itt_marker(const __itt_domain* domain, __itt_id id, __itt_string_handle* name, __itt_scope scope) {
-    if (!domain || !(domain->flags & 1) || !name || !name->strA) return;
-    long long ts_us = get_time_us();
+static void write_marker(const __itt_domain* domain, __itt_string_handle* name,
+                         const __itt_clock_domain* clock_domain, unsigned long long timestamp) {
+    if (!collecting() || !domain || !(domain->flags & 1) || !name || !name->strA || (name->extra1 & kNameFiltered)) return;
+    long long ts_us = resolve_timestamp(clock_domain, timestamp);
     std::string marker_name = std::string(domain->nameA) + "::" + std::string(name->strA);
     std::string entry = "{\"name\": \"" + marker_name + "\", \"cat\": \"marker\", \"ph\": \"R\", \"ts\": " + std::to_string(ts_us) +
                         ", \"pid\": " + std::to_string(getpid()) +
-                        ", \"tid\": " + std::to_string(syscall(SYS_gettid)) + "}";
+                        ", \"tid\": " + std::to_string(event_tid()) + "}";
     write_trace_entry(entry);
 }
 
+void __itt_marker(const __itt_domain* domain, __itt_id, __itt_string_handle* name, __itt_scope) {
+    write_marker(domain, name, nullptr, __itt_timestamp_none);
+}
+
+// --- Clock Domains and *_ex Variants ---
+__itt_clock_domain* __itt_clock_domain_create(__itt_get_clock_info_fn fn, void* fn_data) {
+    __itt_clock_domain* clock_domain = new __itt_clock_domain();
+    clock_domain->fn = fn;
+    clock_domain->fn_data = fn_data;
+    clock_domain->extra2 = new ClockAnchor();
+    query_clock_domain(clock_domain);
+    std::lock_guard<std::mutex> lock(g_clock_domain_mutex);
+    clock_domain->next = g_clock_domains;
+    g_clock_domains = clock_domain;
+    return clock_domain;
+}
+
+void __itt_clock_domain_reset(void) {
+    std::lock_guard<std::mutex> lock(g_clock_domain_mutex);
+    for (__itt_clock_domain* clock_domain = g_clock_domains; clock_domain; clock_domain = clock_domain->next) {
+        query_clock_domain(clock_domain);
+    }
+}
+
+__itt_timestamp __itt_get_timestamp(void) {
+    return static_cast<__itt_timestamp>(get_time_us());
+}
+
+void __itt_task_begin_ex(const __itt_domain* domain, __itt_clock_domain* clock_domain, unsigned long long timestamp,
+                         __itt_id taskid, __itt_id, __itt_string_handle* name) {
+    begin_task(domain, taskid, name, nullptr, clock_domain, timestamp);
+}
+
+void __itt_task_begin_fn_ex(const __itt_domain* domain, __itt_clock_domain* clock_domain, unsigned long long timestamp,
+                            __itt_id taskid, __itt_id, void* fn) {
+    begin_task(domain, taskid, nullptr, fn, clock_domain, timestamp);
+}
+
+void __itt_task_end_ex(const __itt_domain* domain, __itt_clock_domain* clock_domain, unsigned long long timestamp) {
+    end_task(domain, clock_domain, timestamp);
+}
+
+void __itt_task_begin_overlapped_ex(const __itt_domain* domain, __itt_clock_domain* clock_domain, unsigned long long timestamp,
+                                    __itt_id taskid, __itt_id, __itt_string_handle* name) {
+    begin_overlapped(domain, taskid, name, clock_domain, timestamp);
+}
+
+void __itt_task_end_overlapped_ex(const __itt_domain* domain, __itt_clock_domain* clock_domain, unsigned long long timestamp,
+                                  __itt_id taskid) {
+    end_overlapped(domain, taskid, clock_domain, timestamp);
+}
+
+void __itt_marker_ex(const __itt_domain* domain, __itt_clock_domain* clock_domain, unsigned long long timestamp,
+                     __itt_id, __itt_string_handle* name, __itt_scope) {
+    write_marker(domain, name, clock_domain, timestamp);
+}
+
+// Instances and relations carry no timestamps of their own, so the *_ex
+// forms only differ from the plain calls in which arguments they accept.
+void __itt_id_create_ex(const __itt_domain* domain, __itt_clock_domain*, unsigned long long, __itt_id id) {
+    __itt_id_create(domain, id);
+}
+
+void __itt_id_destroy_ex(const __itt_domain* domain, __itt_clock_domain*, unsigned long long, __itt_id id) {
+    __itt_id_destroy(domain, id);
+}
+
+void __itt_relation_add_ex(const __itt_domain* domain, __itt_clock_domain*, unsigned long long,
+                           __itt_id head, __itt_relation relation, __itt_id tail) {
+    __itt_relation_add(domain, head, relation, tail);
+}
+
+void __itt_relation_add_to_current_ex(const __itt_domain* domain, __itt_clock_domain*, unsigned long long,
+                                      __itt_relation relation, __itt_id tail) {
+    __itt_relation_add_to_current(domain, relation, tail);
+}
+
+// --- Track Tracing ---
+static std::mutex g_track_mutex;
+static std::map<__itt_string_handle*, __itt_track_group*>& track_groups() {
+    static auto* groups = new std::map<__itt_string_handle*, __itt_track_group*>();
+    return *groups;
+}
+static std::map<std::pair<__itt_track_group*, __itt_string_handle*>, __itt_track*>& tracks() {
+    static auto* map = new std::map<std::pair<__itt_track_group*, __itt_string_handle*>, __itt_track*>();
+    return *map;
+}
+
+__itt_track_group* __itt_track_group_create(__itt_string_handle* name, __itt_track_group_type track_group_type) {
+    if (!name || !name->strA) return nullptr;
+    std::lock_guard<std::mutex> lock(g_track_mutex);
+    auto it = track_groups().find(name);
+    if (it != track_groups().end()) {
+        return it->second;
+    }
+    __itt_track_group* group = new __itt_track_group();
+    group->name = name;
+    group->tgtype = track_group_type;
+    track_groups()[name] = group;
+    return group;
+}
+
+__itt_track* __itt_track_create(__itt_track_group* track_group, __itt_string_handle* name, __itt_track_type track_type) {
+    if (!name || !name->strA) return nullptr;
+    Track* track_state;
+    __itt_track* track;
+    {
+        std::lock_guard<std::mutex> lock(g_track_mutex);
+        auto key = std::make_pair(track_group, name);
+        auto it = tracks().find(key);
+        if (it != tracks().end()) {
+            return it->second;
+        }
+        track_state = new Track();
+        std::string full_name = track_group && track_group->name && track_group->name->strA
+            ? std::string(track_group->name->strA) + "/" + name->strA
+            : std::string(name->strA);
+        track_state->name = json_escape(full_name.c_str(), full_name.size());
+        track_state->vtid = kTrackTidBase + g_next_track_index.fetch_add(1, std::memory_order_relaxed);
+
+        track = new __itt_track();
+        track->name = name;
+        track->group = track_group;
+        track->ttype = track_type;
+        track->extra2 = track_state;
+        if (track_group) {
+            track->next = track_group->track;
+            track_group->track = track;
+        }
+        tracks()[key] = track;
+    }
+    if (!detached()) {
+        ThreadState descriptor;
+        descriptor.tid = track_state->vtid;
+        descriptor.name = track_state->name;
+        write_thread_name(descriptor);
+    }
+    return track;
+}
+
+void __itt_set_track(__itt_track* track) {
+    if (detached()) return;
+    g_current_track = track ? static_cast<Track*>(track->extra2) : nullptr;
+}
+
+// --- Task Metadata ---
+// Metadata always attaches to the innermost open task on the calling thread;
+// the id argument is not used to look up other task instances.
+void __itt_metadata_add(const __itt_domain* domain, __itt_id, __itt_string_handle* key, __itt_metadata_type type, size_t count, void* data) {
+    if (!collecting() || !domain || !(domain->flags & 1) || !key || !key->strA || !data || count == 0) return;
+    TaskStack& stack = task_stack();
+    size_t size = metadata_type_size(type);
+    if (stack.empty() || size == 0) return;
+    task_args_add(stack.back().args, key, static_cast<uint8_t>(type), static_cast<uint32_t>(count), data, size * count);
+}
+
+void __itt_metadata_str_add(const __itt_domain* domain, __itt_id, __itt_string_handle* key, const char* data, size_t length) {
+    if (!collecting() || !domain || !(domain->flags & 1) || !key || !key->strA || !data) return;
+    TaskStack& stack = task_stack();
+    if (stack.empty()) return;
+    if (length == 0) length = strlen(data);
+    task_args_add(stack.back().args, key, TaskArgs::kStringType, static_cast<uint32_t>(length), data, length);
+}
+
+// --- Heap Tracing ---
+__itt_heap_function __itt_heap_function_create(const char* name, const char* domain) {
+    if (!name) return nullptr;
+    ensure_initialized();
+    std::string full_name = "heap:" + std::string(domain ? domain : "") + (domain ? "::" : "") + name;
+    std::lock_guard<std::mutex> lock(g_heap_function_mutex);
+    auto it = heap_function_map().find(full_name);
+    if (it != heap_function_map().end()) {
+        return it->second;
+    }
+    HeapFunction* function = new HeapFunction();
+    function->name = json_escape(full_name.c_str(), full_name.size());
+    heap_function_map()[full_name] = function;
+    return function;
+}
+
+void __itt_heap_allocate_begin(__itt_heap_function h, size_t, int) {
+    if (g_heap_hooks_blocked) return;
+    if (!collecting() || !h) return;
+    heap_op_begin();
+}
+
+void __itt_heap_allocate_end(__itt_heap_function h, void** addr, size_t size, int) {
+    if (g_heap_hooks_blocked) return;
+    HeapHookBlock block;
+    if (!collecting()) {
+        heap_op_discard();
+        return;
+    }
+    if (!h) return;
+    heap_record_alloc(static_cast<HeapFunction*>(h), addr ? *addr : nullptr, size, heap_op_end());
+}
+
+void __itt_heap_free_begin(__itt_heap_function h, void*) {
+    if (g_heap_hooks_blocked) return;
+    if (!collecting() || !h) return;
+    heap_op_begin();
+}
+
+void __itt_heap_free_end(__itt_heap_function h, void* addr) {
+    if (g_heap_hooks_blocked) return;
+    HeapHookBlock block;
+    if (!collecting()) {
+        heap_op_discard();
+        return;
+    }
+    if (!h) return;
+    heap_record_free(static_cast<HeapFunction*>(h), addr, heap_op_end());
+}
+
+void __itt_heap_reallocate_begin(__itt_heap_function h, void*, size_t, int) {
+    if (g_heap_hooks_blocked) return;
+    if (!collecting() || !h) return;
+    heap_op_begin();
+}
+
+// A reallocation is accounted as a free of the old block plus an allocation of
+// the new one, with the elapsed time charged to the allocation.
+void __itt_heap_reallocate_end(__itt_heap_function h, void* addr, void** new_addr, size_t new_size, int) {
+    if (g_heap_hooks_blocked) return;
+    HeapHookBlock block;
+    if (!collecting()) {
+        heap_op_discard();
+        return;
+    }
+    if (!h) return;
+    HeapFunction* function = static_cast<HeapFunction*>(h);
+    unsigned long long elapsed_ns = heap_op_end();
+    if (addr) heap_record_free(function, addr, 0);
+    heap_record_alloc(function, new_addr ? *new_addr : nullptr, new_size, elapsed_ns);
+}
+
+// --- Sync Object Tracing ---
+void __itt_sync_create(void* addr, const char* objtype, const char* objname, int) {
+    if (detached() || !addr) return;
+    ensure_initialized();
+    set_sync_object(addr, new_sync_object(addr, (objname && *objname) ? objname : objtype));
+}
+
+void __itt_sync_rename(void* addr, const char* name) {
+    if (detached() || !addr || !name) return;
+    // Renaming starts a new object so that earlier statistics keep their old name.
+    set_sync_object(addr, new_sync_object(addr, name));
+}
+
+void __itt_sync_destroy(void* addr) {
+    if (detached() || !addr) return;
+    SyncObject* object = nullptr;
+    if (sync_objects().take(addr, object)) retire_sync_object(object);
+}
+
+void __itt_sync_prepare(void* addr) {
+    if (!collecting() || !addr) return;
+    g_sync_prepares.push_back({addr, find_sync_object(addr), get_time_ns()});
+}
+
+void __itt_sync_cancel(void* addr) {
+    if (detached()) return;
+    SyncPending pending;
+    take_sync_pending(g_sync_prepares, addr, pending);
+}
+
+void __itt_sync_acquired(void* addr) {
+    if (!collecting()) {
+        // Still retire a prepare from before the pause so it cannot pair up
+        // with a later acquisition of the same lock.
+        SyncPending stale;
+        if (!detached()) take_sync_pending(g_sync_prepares, addr, stale);
+        return;
+    }
+    if (!addr) return;
+    long long now_ns = get_time_ns();
+    SyncPending pending;
+    SyncObject* object;
+    if (take_sync_pending(g_sync_prepares, addr, pending)) {
+        object = pending.object;
+        unsigned long long wait_ns = static_cast<unsigned long long>(now_ns - pending.start_ns);
+        object->waits.fetch_add(1, std::memory_order_relaxed);
+        object->total_wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+        atomic_max(object->max_wait_ns, wait_ns);
+        if (static_cast<long long>(wait_ns) >= sync_wait_threshold_ns()) {
+            std::string entry = "{\"name\": \"wait:" + object->name + "\", \"cat\": \"sync\", \"ph\": \"X\", \"ts\": " +
+                                std::to_string(pending.start_ns / 1000) + ", \"dur\": " + std::to_string(wait_ns / 1000) +
+                                ", \"pid\": " + std::to_string(getpid()) + ", \"tid\": " + std::to_string(current_tid()) + "}";
+            write_trace_entry(entry);
+        }
+    } else {
+        object = find_sync_object(addr);
+    }
+    object->acquisitions.fetch_add(1, std::memory_order_relaxed);
+    g_sync_holds.push_back({addr, object, now_ns});
+}
+
+void __itt_sync_releasing(void* addr) {
+    if (detached()) return;
+    SyncPending held;
+    if (!take_sync_pending(g_sync_holds, addr, held) || !collecting()) return;
+    unsigned long long hold_ns = static_cast<unsigned long long>(get_time_ns() - held.start_ns);
+    held.object->total_hold_ns.fetch_add(hold_ns, std::memory_order_relaxed);
+    atomic_max(held.object->max_hold_ns, hold_ns);
+}
+
+// --- Histogram Tracing ---
+__itt_histogram* __itt_histogram_create(const __itt_domain* domain, const char* name, __itt_metadata_type x_type, __itt_metadata_type y_type) {
+    if (!domain || !name) return nullptr;
+    ensure_initialized();
+    std::lock_guard<std::mutex> lock(g_histogram_mutex);
+    auto key = std::make_pair(domain, std::string(name));
+    auto it = histograms().find(key);
+    if (it != histograms().end()) {
+        return it->second;
+    }
+    HistogramState* state = new HistogramState();
+    state->domain = json_escape(domain->nameA, strlen(domain->nameA));
+    state->name = json_escape(name, strlen(name));
+    __itt_histogram* hist = new __itt_histogram();
+    char* name_copy = new char[strlen(name) + 1];
+    strcpy(name_copy, name);
+    hist->domain = domain;
+    hist->nameA = name_copy;
+    hist->nameW = nullptr;
+    hist->x_type = x_type;
+    hist->y_type = y_type;
+    hist->extra2 = state;
+    histograms()[key] = hist;
+    return hist;
+}
+
+void __itt_histogram_submit(__itt_histogram* hist, size_t length, void* x_data, void* y_data) {
+    if (!collecting() || !hist || !hist->extra2 || length == 0 || (!x_data && !y_data)) return;
+    if (!hist->domain || !(hist->domain->flags & 1)) return;
+    HistogramAccum* accum = thread_histogram_accum(static_cast<HistogramState*>(hist->extra2));
+    submit_histogram(*accum, hist, length, x_data, y_data);
+}
+
+// --- Module Tracking ---
+// Modules announced through the ITT calls (JIT code, custom loaders) are kept
+// alongside the loader's list and survive rescans until
+// __itt_module_unload.
+void __itt_module_load(void* start_addr, void* end_addr, const char* path) {
+    if (detached() || !start_addr) return;
+    ensure_initialized();
+    scan_modules();
+    ModuleInfo module;
+    module.path = path ? path : "";
+    module.base = module.start = reinterpret_cast<uintptr_t>(start_addr);
+    module.end = reinterpret_cast<uintptr_t>(end_addr);
+    module.from_itt = true;
+    ModuleTable& table = module_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    write_module_entry(module, "load");
+    table.modules[std::make_pair(module.path, module.base)] = module;
+}
+
+void __itt_module_unload(void* addr) {
+    if (detached() || !addr) return;
+    ensure_initialized();
+    scan_modules();
+    ModuleTable& table = module_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    for (auto it = table.modules.begin(); it != table.modules.end(); ++it) {
+        if (it->second.start == reinterpret_cast<uintptr_t>(addr)) {
+            write_module_entry(it->second, "unload");
+            table.modules.erase(it);
+            return;
+        }
+    }
+}
+
+// Rescans around the real dlclose: first to record anything dlopen'ed since
+// the last scan while it is still mapped, then to record what was unloaded.
+int dlclose(void* handle) {
+    static auto real_dlclose = reinterpret_cast<int (*)(void*)>(dlsym(RTLD_NEXT, "dlclose"));
+    if (!real_dlclose) return -1;
+    if (detached() || !initialized()) return real_dlclose(handle);
+    flush_all_buffers(); // resolve pending function names while the module is mapped
+    scan_modules();
+    int result = real_dlclose(handle);
+    scan_modules();
+    return result;
+}
+
+// --- Collector Entry Point ---
+// Called by ittnotify with its global lock held, so this must not make ITT
+// calls itself; the tracer still starts lazily on the first real one.
+void __itt_api_init(void* global_ptr, int init_groups) {
+    IttGlobalHead* global = static_cast<IttGlobalHead*>(global_ptr);
+    if (!global) return;
+    if (memcmp(global->magic, kIttGlobalMagic, sizeof(kIttGlobalMagic)) != 0) {
+        fprintf(stderr, "[colintrace] Unrecognized ittnotify table, collector mode disabled\n");
+        return;
+    }
+    adopt_itt_handles(global);
+    int wired = fill_api_table(global, init_groups);
+    fprintf(stderr, "[colintrace] Collector mode: %d ITT entry points routed to colintrace\n", wired);
+}
+
 // --- Empty stubs for other ITT functions to ensure binary compatibility ---
-void __itt_metadata_add(const __itt_domain* domain, __itt_id id, __itt_string_handle* key, __itt_metadata_type type, size_t count, void* data) {}
-void __itt_relation_add_to_current(const __itt_domain* domain, __itt_relation relation, __itt_id tail) {}
-void __itt_relation_add(const __itt_domain* domain, __itt_id head, __itt_relation relation, __itt_id tail) {}
 void __itt_task_group(const __itt_domain* domain, __itt_id id, __itt_id parentid, __itt_string_handle* name) {}
 // Might need to add more later
 
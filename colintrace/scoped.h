@@ -0,0 +1,100 @@
+#pragma once
+
+// Header-only RAII instrumentation on top of the ITT entry points in
+// colintrace.h, for code that can depend on colintrace directly.
+//
+//   void step() {
+//       COLINTRACE_TASK("app", "step");      // ends when the scope exits
+//       COLINTRACE_FUNCTION_TASK("app");     // named after the function
+//       COLINTRACE_TASK_AT(2, "app", "inner");
+//   }
+//
+// Every macro expansion owns function-local statics, so the domain and name
+// handles are created once per call site on first use and each begin/end
+// afterwards is a flag check plus the ITT call. Variables are numbered with
+// __COUNTER__, so several tasks can be opened on one line (e.g. from another
+// macro). Tasks whose level is above
+// COLINTRACE_LEVEL compile to nothing and never create their handles;
+// build with -DCOLINTRACE_LEVEL=0 to remove all of them.
+//
+// Works both with direct calls (INTEL_NO_MACRO_BODY, LD_PRELOAD) and through
+// the static ittnotify macros in collector mode.
+#include "colintrace.h"
+
+#ifndef COLINTRACE_LEVEL
+#define COLINTRACE_LEVEL 1
+#endif
+
+namespace colintrace {
+
+template <int Level>
+inline constexpr bool level_enabled = Level <= COLINTRACE_LEVEL;
+
+// Begins a task on construction and ends it on destruction. A task on a
+// disabled domain (flags bit 0 clear, see COLINTRACE_DOMAINS) is not begun
+// and so not ended either.
+template <int Level = 1>
+class ScopedTask {
+public:
+    ScopedTask(const __itt_domain* domain, __itt_string_handle* name) {
+        if constexpr (level_enabled<Level>) {
+            if (domain && (domain->flags & 1)) {
+                domain_ = domain;
+                __itt_task_begin(domain, __itt_null, __itt_null, name);
+            }
+        }
+    }
+
+    // Task named by a function address; colintrace symbolizes it when the
+    // task is written.
+    ScopedTask(const __itt_domain* domain, void* fn) {
+        if constexpr (level_enabled<Level>) {
+            if (domain && (domain->flags & 1)) {
+                domain_ = domain;
+                __itt_task_begin_fn(domain, __itt_null, __itt_null, fn);
+            }
+        }
+    }
+
+    ~ScopedTask() {
+        if constexpr (level_enabled<Level>) {
+            if (domain_) __itt_task_end(domain_);
+        }
+    }
+
+    ScopedTask(const ScopedTask&) = delete;
+    ScopedTask& operator=(const ScopedTask&) = delete;
+
+private:
+    const __itt_domain* domain_ = nullptr;
+};
+
+} // namespace colintrace
+
+#define COLINTRACE_CONCAT_(a, b) a##b
+#define COLINTRACE_CONCAT(a, b) COLINTRACE_CONCAT_(a, b)
+
+// Handles cached in a static local of a lambda unique to the expansion. The
+// name is passed in rather than captured so that __func__ refers to the
+// enclosing function.
+#define COLINTRACE_DOMAIN(name) \
+    ([](const char* n) { static __itt_domain* const d = __itt_domain_create(n); return d; }(name))
+#define COLINTRACE_NAME(name) \
+    ([](const char* n) { static __itt_string_handle* const h = __itt_string_handle_create(n); return h; }(name))
+
+#define COLINTRACE_TASK_AT(level, domain_name, task_name)                                                   \
+    ::colintrace::ScopedTask<level> COLINTRACE_CONCAT(colintrace_task_, __COUNTER__)(                          \
+        ::colintrace::level_enabled<level> ? COLINTRACE_DOMAIN(domain_name) : nullptr,                      \
+        ::colintrace::level_enabled<level> ? COLINTRACE_NAME(task_name) : nullptr)
+
+#define COLINTRACE_TASK(domain_name, task_name) COLINTRACE_TASK_AT(1, domain_name, task_name)
+
+#define COLINTRACE_FUNCTION_TASK(domain_name) COLINTRACE_TASK_AT(1, domain_name, __func__)
+
+// Task named by a function pointer instead of a string handle.
+#define COLINTRACE_FN_TASK_AT(level, domain_name, fn)                                                       \
+    ::colintrace::ScopedTask<level> COLINTRACE_CONCAT(colintrace_task_, __COUNTER__)(                          \
+        ::colintrace::level_enabled<level> ? COLINTRACE_DOMAIN(domain_name) : nullptr,                      \
+        reinterpret_cast<void*>(fn))
+
+#define COLINTRACE_FN_TASK(domain_name, fn) COLINTRACE_FN_TASK_AT(1, domain_name, fn)